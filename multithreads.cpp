@@ -27,9 +27,20 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <new>
 #include <vector>
 #include <string>
 
+#include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -38,6 +49,8 @@
  * EGL headers.
  */
 #include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <EGL/eglext_angle.h>
 
 /*
  * OpenGL headers.
@@ -46,9 +59,22 @@
 #include <GLES/gl.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <GLES3/gl3.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #ifdef __linux__
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/un.h>
 #elif _WIN32
 #include <windows.h>
 #endif
@@ -189,12 +215,9 @@ void draw_triangle(GLsizei width, GLsizei height)
 
 	GLuint program = CompileProgram(vShaderStr, fShaderStr);
 
-	// Set the viewport
+	// Set the viewport; clearing is left to the render pass
 	glViewport(0, 0, width, height);
 
-	// Clear the color buffer
-	glClear(GL_COLOR_BUFFER_BIT);
-
 	// Use the program object
 	glUseProgram(program);
 
@@ -205,370 +228,5743 @@ void draw_triangle(GLsizei width, GLsizei height)
 	glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
-typedef struct GLContext {
-    EGLDisplay dpy;
-	EGLConfig config;
-	EGLint width;
-	EGLint height;
-} GLContext;
-
-GLuint CreateSimpleTexture2D()
+static uint64_t NowNs()
 {
-    // Use tightly packed data
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-    // Generate a texture object
-    GLuint texture;
-    glGenTextures(1, &texture);
-
-    // Bind the texture object
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // Load the texture: 2x2 Image, 3 bytes per pixel (R, G, B)
-    const size_t width                 = 2;
-    const size_t height                = 2;
-    GLubyte pixels[width * height * 3] = {
-        255, 0,   0,    // Red
-        0,   255, 0,    // Green
-        0,   0,   255,  // Blue
-        255, 255, 0,    // Yellow
-    };
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
 
-    // Set the filtering mode
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+///
+// Dry run: on the null backend every GL call is a no-op and readbacks
+// return nothing useful, so each readback is replaced by synthetic pixels
+// that depend only on the seed. The rest of the pipeline runs unchanged,
+// which measures our own CPU overhead deterministically.
+//
+static bool gDryRun = false;
 
-    return texture;
+void SyntheticPixels(uint8_t *rgba, GLsizei width, GLsizei height, GLsizei stride, uint64_t seed)
+{
+	for (GLsizei y = 0; y < height; y++) {
+		uint32_t *row = (uint32_t *)(rgba + (size_t)y * stride);
+		const uint32_t green = (uint32_t)(y * 2 + seed) & 0xff;
+		const uint32_t bar = (uint32_t)((seed * 7) % (width > 0 ? width : 1));
+		for (GLsizei x = 0; x < width; x++) {
+			uint32_t r = (uint32_t)(x + seed) & 0xff;
+			uint32_t g = green;
+			uint32_t b = (uint32_t)(x ^ y) & 0xff;
+			// A moving bar, so consecutive frames differ
+			if ((uint32_t)x - bar < 16)
+				r = g = 0xff;
+			row[x] = r | g << 8 | b << 16 | 0xffu << 24;
+		}
+	}
 }
 
-void *thread_func_a(void *userdata)
+///
+// Synthetic 4:2:0 frame, I420 or NV12: the chroma bytes follow the luma
+// plane in either layout, so one pattern serves both.
+//
+void SyntheticYUV(uint8_t *yuv, GLsizei width, GLsizei height, uint64_t seed)
 {
-    
-    GLContext *glCtx = static_cast<GLContext *>(userdata);
-	EGLDisplay dpy = glCtx->dpy;
-	EGLConfig config = glCtx->config;
-	EGLSurface surface;
-	EGLContext context;
-	EGLint width = glCtx->width;
-	EGLint height = glCtx->height;
-	printf("Thread inside %#x display %p config %p width %d height %d\n",
-		gettid(), dpy, config, width, height);
-#if 0
-	dpy = eglGetDisplay((EGLNativeDisplayType)0);
-	if (!eglInitialize(dpy, NULL, NULL)) {
-		assertEGLError("eglGetDisplay");
-		printf("failed to initialize display\n");
-		return 0;
+	const uint32_t bar = (uint32_t)((seed * 7) % (width > 0 ? width : 1));
+	for (GLsizei y = 0; y < height; y++) {
+		uint8_t *row = yuv + (size_t)y * width;
+		for (GLsizei x = 0; x < width; x++)
+			row[x] = (uint32_t)x - bar < 16 ? 0xeb : (uint8_t)((x ^ y) + seed);
 	}
-	const GLint configAttribs[] = {
-		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
-		EGL_NONE
-	};
-	int n;
-	if (!eglChooseConfig(dpy, configAttribs,
-		&config, 1, &n) || n == 0) {
-		assertEGLError("eglChooseConfig");
-		printf("%s: Could not find GLES 2.x config!\n", __FUNCTION__);
-		return 0;
+	uint8_t *chroma = yuv + (size_t)width * height;
+	for (GLsizei y = 0; y < height / 2; y++) {
+		for (GLsizei x = 0; x < width; x++)
+			chroma[(size_t)y * width + x] = (uint8_t)(0x80 + ((x + y * 3 + seed) & 0x3f) - 0x20);
 	}
-#endif
-	// Create a pbuffer surface
-	const EGLint pbufAttribs[] = {
-		EGL_WIDTH, width,
-		EGL_HEIGHT, height,
-		EGL_NONE
-	};
-    surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
-	assertEGLError("eglCreatePbufferSurface");
-	// Create a GL context
-	static const GLint contextAttribs[] = {
-		EGL_CONTEXT_CLIENT_VERSION, 2,
-		EGL_NONE
-	};
+}
 
-	context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
-	assertEGLError("eglCreateContext");
+///
+// Metrics.
+//
+// A fixed registry of counters, gauges and latency histograms that the hot
+// paths update without locks. Counters are sharded per thread on separate
+// cache lines and only summed when dumped. Histograms bucket nanoseconds
+// log-linearly, HDR style: 8 sub-buckets per power of two keep the relative
+// error under 12.5% over the whole 64-bit range in 496 buckets.
+//
+static const int kMetricShards = 16;
+static const int kHistogramSubBits = 3;
+static const int kHistogramBuckets = (64 - kHistogramSubBits + 1) << kHistogramSubBits;
 
-	printf("thread %lx display %p context %p surface %p\n", gettid(), dpy, context, surface);
-	// Make the context current
-	if (!eglMakeCurrent(dpy, surface, surface, context)) {
-		assertEGLError("eglMakeCurrent");
-		printf("failed to create context\n");
-		return 0;
-	}
+typedef struct alignas(64) MetricShard {
+	std::atomic<uint64_t> value;
+} MetricShard;
 
-	/*
-	 * 1. Create an OpenGL framebuffer as render target.
-	 */
-	GLuint frameBuffer;
-	glGenFramebuffers(1, &frameBuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-	assertOpenGLError("glBindFramebuffer");
+typedef struct MetricCounter {
+	const char *name;
+	const char *help;
+	MetricShard shards[kMetricShards];
+} MetricCounter;
 
-	/*
-	 * 2. Create a texture as color attachment.
-	 */
-	GLuint tex;
-	glGenTextures(1, &tex);
+typedef struct MetricGauge {
+	const char *name;
+	const char *help;
+	std::atomic<int64_t> value;
+} MetricGauge;
 
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
-	assertOpenGLError("glTexImage2D");
+typedef struct MetricHistogram {
+	const char *name;
+	const char *help;
+	std::atomic<uint64_t> buckets[kHistogramBuckets];
+	std::atomic<uint64_t> sum;
+	std::atomic<uint64_t> count;
+} MetricHistogram;
 
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_MIN_FILTER");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_MAG_FILTER");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_WRAP_S");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_WRAP_T");
-	glBindTexture(GL_TEXTURE_2D, 0);
-	assertOpenGLError("glBindTexture");
-    /*
-	 * 3. Attach the texture to the framebuffer.
-	 */
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
-	assertOpenGLError("glFramebufferTexture2D");
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	/*
-	 * 4. Read the framebuffer's color attachment and save it as a PNG file.
-	 */
-	GLsizei nr_channels = 4;
-	GLsizei stride = nr_channels * width;
-	stride += (stride % 4) ? (4 - stride % 4) : 0;
-	GLsizei bufferSize = stride * height;
-	std::vector<char> buffer(bufferSize);
+typedef struct Metrics {
+	MetricCounter framesRendered;
+	MetricCounter framesEncoded;
+	MetricCounter framesSkipped;
+	MetricCounter readbackBytes;
+	MetricCounter deadlineMisses;
+	MetricCounter filesWritten;
+	MetricGauge uploadQueueDepth;
+	MetricGauge fencesPending;
+	MetricHistogram renderLatency;
+	MetricHistogram readbackLatency;
+	MetricHistogram encodeLatency;
+} Metrics;
 
-	//
-	// intialize program data
-	//
-	constexpr char kVS[] = R"(attribute vec4 a_position;
-attribute vec2 a_texCoord;
-varying vec2 v_texCoord;
-void main()
+static Metrics gMetrics = {
+	{ "frames_rendered_total", "Frames drawn by render workers", {} },
+	{ "frames_encoded_total", "Frames encoded and written out", {} },
+	{ "frames_skipped_total", "Frames not encoded because they were unchanged", {} },
+	{ "readback_bytes_total", "Bytes moved by glReadPixels", {} },
+	{ "deadline_misses_total", "Jobs whose fence missed its deadline", {} },
+	{ "files_written_total", "Files completed by the asynchronous writer", {} },
+	{ "upload_queue_depth", "Assets waiting for the upload thread", {} },
+	{ "fences_pending", "Fences submitted to a reaper and not yet reaped", {} },
+	{ "render_seconds", "Time from fence submission to GPU completion", {}, {}, {} },
+	{ "readback_seconds", "Time spent in readback per frame", {}, {}, {} },
+	{ "encode_seconds", "Time spent encoding and writing per frame", {}, {}, {} },
+};
+
+static std::atomic<int> gNextMetricShard(0);
+static thread_local int tMetricShard = -1;
+
+void MetricAdd(MetricCounter *counter, uint64_t n = 1)
 {
-    gl_Position = a_position;
-    v_texCoord = a_texCoord;
-})";
+	if (tMetricShard < 0)
+		tMetricShard = gNextMetricShard.fetch_add(1, std::memory_order_relaxed) % kMetricShards;
+	counter->shards[tMetricShard].value.fetch_add(n, std::memory_order_relaxed);
+}
 
-	constexpr char kFS[] = R"(precision mediump float;
-varying vec2 v_texCoord;
-uniform sampler2D s_texture;
-void main()
+uint64_t MetricValue(const MetricCounter *counter)
 {
-    gl_FragColor = texture2D(s_texture, v_texCoord);
-})";
-	GLuint mProgram = CompileProgram(kVS, kFS);
-	if (!mProgram)
-	{
-		return 0;
-	}
+	uint64_t total = 0;
+	for (const MetricShard &shard : counter->shards)
+		total += shard.value.load(std::memory_order_relaxed);
+	return total;
+}
 
-	// Get the attribute locations
-	GLint mPositionLoc = glGetAttribLocation(mProgram, "a_position");
-	GLint mTexCoordLoc = glGetAttribLocation(mProgram, "a_texCoord");
+void MetricGaugeAdd(MetricGauge *gauge, int64_t n)
+{
+	gauge->value.fetch_add(n, std::memory_order_relaxed);
+}
 
-	// Get the sampler location
-	GLint mSamplerLoc = glGetUniformLocation(mProgram, "s_texture");
+static int HistogramBucket(uint64_t value)
+{
+	if (value < (1u << kHistogramSubBits))
+		return (int)value;
+	int msb = 63 - __builtin_clzll(value);
+	int shift = msb - kHistogramSubBits;
+	return ((shift + 1) << kHistogramSubBits) + (int)((value >> shift) & ((1u << kHistogramSubBits) - 1));
+}
 
-	// Load the texture
-	GLuint mTexture = CreateSimpleTexture2D();
+// Exclusive upper bound of a bucket.
+static uint64_t HistogramBucketLimit(int bucket)
+{
+	if (bucket < (1 << kHistogramSubBits))
+		return bucket + 1;
+	int shift = (bucket >> kHistogramSubBits) - 1;
+	uint64_t sub = bucket & ((1 << kHistogramSubBits) - 1);
+	uint64_t base = (1ull << kHistogramSubBits) + sub + 1;
+	// The top buckets reach past 2^64; they end at the largest value
+	if (base > (UINT64_MAX >> shift))
+		return UINT64_MAX;
+	return base << shift;
+}
 
-	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+void MetricRecord(MetricHistogram *histogram, uint64_t ns)
+{
+	histogram->buckets[HistogramBucket(ns)].fetch_add(1, std::memory_order_relaxed);
+	histogram->sum.fetch_add(ns, std::memory_order_relaxed);
+	histogram->count.fetch_add(1, std::memory_order_relaxed);
+}
 
-	int mRunning = 1;
-	while (mRunning) {
-		GLfloat vertices[] = {
-			-0.5f, 0.5f,  0.0f,  // Position 0
-			0.0f,  0.0f,         // TexCoord 0
-			-0.5f, -0.5f, 0.0f,  // Position 1
-			0.0f,  1.0f,         // TexCoord 1
-			0.5f,  -0.5f, 0.0f,  // Position 2
-			1.0f,  1.0f,         // TexCoord 2
-			0.5f,  0.5f,  0.0f,  // Position 3
-			1.0f,  0.0f          // TexCoord 3
-		};
-		GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
-		// 5. before drawing, bind framebuffer
-		glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-		assertOpenGLError("glBindFramebuffer");
-		
-		// Set the viewport
-		glViewport(0, 0, width, height);
-
-		// Clear the color buffer
-		glClear(GL_COLOR_BUFFER_BIT);
+///
+// Histogram bucket bounds in the exposition, 1 us to 10 s in 1-2-5 steps.
+// They are the same in every dump so that the series stay stable.
+//
+static const uint64_t kMetricLeNs[] = {
+	1000ull, 2000ull, 5000ull,
+	10000ull, 20000ull, 50000ull,
+	100000ull, 200000ull, 500000ull,
+	1000000ull, 2000000ull, 5000000ull,
+	10000000ull, 20000000ull, 50000000ull,
+	100000000ull, 200000000ull, 500000000ull,
+	1000000000ull, 2000000000ull, 5000000000ull,
+	10000000000ull,
+};
+static const size_t kMetricLeCount = sizeof(kMetricLeNs) / sizeof(kMetricLeNs[0]);
 
-		// Use the program object
-		glUseProgram(mProgram);
+///
+// Write every metric in the Prometheus text exposition format. Histograms
+// list the fixed kMetricLeNs bounds plus +Inf.
+//
+void MetricsWritePrometheus(FILE *out)
+{
+	static const char kPrefix[] = "multithreads_";
+	MetricCounter *counters[] = {
+		&gMetrics.framesRendered, &gMetrics.framesEncoded, &gMetrics.framesSkipped,
+		&gMetrics.readbackBytes, &gMetrics.deadlineMisses, &gMetrics.filesWritten,
+	};
+	MetricGauge *gauges[] = { &gMetrics.uploadQueueDepth, &gMetrics.fencesPending };
+	MetricHistogram *histograms[] = {
+		&gMetrics.renderLatency, &gMetrics.readbackLatency, &gMetrics.encodeLatency,
+	};
 
-		// Load the vertex position
-		glVertexAttribPointer(mPositionLoc, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), vertices);
-		// Load the texture coordinate
-		glVertexAttribPointer(mTexCoordLoc, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat),
-			vertices + 3);
+	for (MetricCounter *c : counters) {
+		uint64_t total = MetricValue(c);
+		fprintf(out, "# HELP %s%s %s\n# TYPE %s%s counter\n%s%s %llu\n", kPrefix, c->name, c->help,
+			kPrefix, c->name, kPrefix, c->name, (unsigned long long)total);
+	}
+	for (MetricGauge *g : gauges) {
+		fprintf(out, "# HELP %s%s %s\n# TYPE %s%s gauge\n%s%s %lld\n", kPrefix, g->name, g->help,
+			kPrefix, g->name, kPrefix, g->name, (long long)g->value.load(std::memory_order_relaxed));
+	}
+	for (MetricHistogram *h : histograms) {
+		fprintf(out, "# HELP %s%s %s\n# TYPE %s%s histogram\n", kPrefix, h->name, h->help, kPrefix, h->name);
+		// Fold the fine buckets into the fixed le set; a fine bucket counts
+		// towards the first le that holds all of its values
+		uint64_t cumulative = 0;
+		size_t le = 0;
+		for (int i = 0; i < kHistogramBuckets; i++) {
+			const uint64_t largest = HistogramBucketLimit(i) - 1;
+			for (; le < kMetricLeCount && largest > kMetricLeNs[le]; le++)
+				fprintf(out, "%s%s_bucket{le=\"%.9g\"} %llu\n", kPrefix, h->name,
+					kMetricLeNs[le] / 1e9, (unsigned long long)cumulative);
+			cumulative += h->buckets[i].load(std::memory_order_relaxed);
+		}
+		for (; le < kMetricLeCount; le++)
+			fprintf(out, "%s%s_bucket{le=\"%.9g\"} %llu\n", kPrefix, h->name,
+				kMetricLeNs[le] / 1e9, (unsigned long long)cumulative);
+		// Samples racing with the dump may show in count but not the buckets
+		uint64_t count = h->count.load(std::memory_order_relaxed);
+		count = count > cumulative ? count : cumulative;
+		fprintf(out, "%s%s_bucket{le=\"+Inf\"} %llu\n", kPrefix, h->name, (unsigned long long)count);
+		fprintf(out, "%s%s_sum %.9f\n", kPrefix, h->name, h->sum.load(std::memory_order_relaxed) / 1e9);
+		fprintf(out, "%s%s_count %llu\n", kPrefix, h->name, (unsigned long long)count);
+	}
+}
 
-		glEnableVertexAttribArray(mPositionLoc);
-		glEnableVertexAttribArray(mTexCoordLoc);
+///
+// Metrics exporter: serves a dump to every client connecting to a Unix
+// socket, and rewrites a file on SIGUSR1 and at shutdown. Either is optional.
+//
+typedef struct MetricsExporter {
+	const char *path;
+	const char *socketPath;
+	int listenFd;
+	pthread_t thread;
+	std::atomic<bool> running;
+} MetricsExporter;
 
-		// Bind the texture
-		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, mTexture);
+static volatile sig_atomic_t gMetricsDumpRequested = 0;
 
-		// Set the texture sampler to texture unit to 0
-		glUniform1i(mSamplerLoc, 0);
-		EGLDisplay curDisplay = eglGetCurrentDisplay();
-		EGLSurface curSurface = eglGetCurrentSurface(EGL_READ);
-		EGLContext curContext = eglGetCurrentContext();
-		printf("thread %lx display %p context %p surface %p\n", gettid(), curDisplay, curContext, curSurface);
-		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
-		assertOpenGLError("glDrawElements");
-		glBindTexture(GL_TEXTURE_2D, 0);
+static void metrics_signal_handler(int)
+{
+	gMetricsDumpRequested = 1;
+}
 
-		// 6. read
-		//glReadPixels: format only accepts GL_RGBA and GL_RGBA_INTEGER. 
-		//type must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_INT, GL_INT, or GL_FLOAT.
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		assertOpenGLError("glPixelStorei");
-		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
-		assertOpenGLError("glReadPixels");
-		stbi_write_png("img.png", width, height, nr_channels, buffer.data(), stride);
-		// unbind framebuffer
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
-		printf("finish saving img.png\n");
+static bool MetricsWriteFile(const char *path)
+{
+	std::string tmp = std::string(path) + ".tmp";
+	FILE *file = fopen(tmp.c_str(), "w");
+	if (!file) {
+		printf("cannot open %s\n", tmp.c_str());
+		return false;
 	}
-	glDeleteFramebuffers(1, &frameBuffer);
-	glDeleteTextures(1, &tex);
-    glDeleteProgram(mProgram);
-	glDeleteTextures(1, &mTexture);
-	eglDestroySurface(dpy, surface);
-	assertEGLError("eglDestroySurface");
-	eglDestroyContext(dpy, context);
-	assertEGLError("eglDestroyContext");
-#if 0
-	eglTerminate(dpy);
-	assertEGLError("eglTerminate");
-#endif
-	return 0;
+	MetricsWritePrometheus(file);
+	if (fclose(file) != 0 || rename(tmp.c_str(), path) != 0) {
+		printf("cannot write %s\n", path);
+		return false;
+	}
+	return true;
 }
 
-void *thread_func_b(void *userdata)
+static void MetricsServe(int fd)
 {
-    GLContext *glCtx = static_cast<GLContext *>(userdata);
-	EGLDisplay dpy = glCtx->dpy;
-	EGLConfig config = glCtx->config;
-	EGLint width = glCtx->width;
-	EGLint height = glCtx->height;
-	EGLSurface surface;
-	EGLContext context;
-	printf("Thread inside %#x display %p config %p\n", gettid(), dpy, config);
+	char *text = nullptr;
+	size_t size = 0;
+	FILE *out = open_memstream(&text, &size);
+	if (!out)
+		return;
+	MetricsWritePrometheus(out);
+	fclose(out);
+	for (size_t sent = 0; sent < size; ) {
+		ssize_t n = send(fd, text + sent, size - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			break;
+		sent += n;
+	}
+	free(text);
+}
 
-	// Create a GL context
-	static const GLint contextAttribs[] = {
-		EGL_CONTEXT_CLIENT_VERSION, 2,
-		EGL_NONE
-	};
-	context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
-	assertEGLError("eglCreateContext");
+static void *metrics_thread_func(void *userdata)
+{
+	MetricsExporter *exporter = static_cast<MetricsExporter *>(userdata);
 
-	static const EGLint pbufAttribs[] = {
-		EGL_WIDTH, width,
-		EGL_HEIGHT, height,
-		EGL_NONE
-	};
+	while (exporter->running.load(std::memory_order_acquire)) {
+		struct pollfd pfd = { exporter->listenFd, POLLIN, 0 };
+		int ready = poll(&pfd, exporter->listenFd >= 0 ? 1 : 0, 200);
+		if (ready > 0) {
+			int client = accept(exporter->listenFd, NULL, NULL);
+			if (client >= 0) {
+				MetricsServe(client);
+				close(client);
+			}
+		}
+		if (gMetricsDumpRequested && exporter->path) {
+			gMetricsDumpRequested = 0;
+			MetricsWriteFile(exporter->path);
+		}
+	}
+	return 0;
+}
 
-	surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
-	assertEGLError("eglCreatePbufferSurface");
-	
-	eglMakeCurrent(dpy, surface, surface, context);
-	assertEGLError("eglMakeCurrent");
-	
-	/*
-	 * Create an OpenGL framebuffer as render target.
-	 */
-	GLuint frameBuffer;
-	glGenFramebuffers(1, &frameBuffer);
-	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-	assertOpenGLError("glBindFramebuffer");
+bool MetricsExporterStart(MetricsExporter *exporter, const char *path, const char *socketPath)
+{
+	exporter->path = path;
+	exporter->socketPath = socketPath;
+	exporter->listenFd = -1;
 
-	/*
-	 * Create a texture as color attachment.
-	 */
-	GLuint tex;
-	glGenTextures(1, &tex);
+	if (socketPath) {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+			printf("metrics socket path too long: %s\n", socketPath);
+			return false;
+		}
+		strcpy(addr.sun_path, socketPath);
+		unlink(socketPath);
+		exporter->listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (exporter->listenFd < 0 || bind(exporter->listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+				listen(exporter->listenFd, 8) != 0) {
+			printf("cannot listen on %s: %s\n", socketPath, strerror(errno));
+			if (exporter->listenFd >= 0)
+				close(exporter->listenFd);
+			return false;
+		}
+	}
+	if (path)
+		signal(SIGUSR1, metrics_signal_handler);
+
+	exporter->running.store(true, std::memory_order_release);
+	pthread_create(&exporter->thread, NULL, metrics_thread_func, exporter);
+	return true;
+}
+
+///
+// Stop serving and write the final numbers to the metrics file.
+//
+void MetricsExporterStop(MetricsExporter *exporter)
+{
+	exporter->running.store(false, std::memory_order_release);
+	pthread_join(exporter->thread, NULL);
+	if (exporter->listenFd >= 0) {
+		close(exporter->listenFd);
+		unlink(exporter->socketPath);
+	}
+	if (exporter->path)
+		MetricsWriteFile(exporter->path);
+}
+
+///
+// Tracing.
+//
+// Scoped markers record complete events into a ring buffer owned by the
+// calling thread, so recording takes no locks and only the newest
+// kTraceCapacity events per thread are kept. With tracing disabled a marker
+// costs one relaxed load. TraceWriteJSON writes every buffer in the Chrome
+// trace event format, for chrome://tracing or ui.perfetto.dev, once the
+// traced threads have finished.
+//
+static const size_t kTraceCapacity = 1 << 16;
+static const int kMaxTraceThreads = 64;
+
+typedef struct TraceEvent {
+	const char *name;     // string literals only, they are not copied
+	const char *category;
+	uint64_t begin_ns;
+	uint64_t end_ns;
+} TraceEvent;
+
+typedef struct TraceBuffer {
+	pid_t tid;
+	char threadName[32];
+	uint64_t head;  // events ever recorded; the ring holds the last ones
+	TraceEvent events[kTraceCapacity];
+} TraceBuffer;
+
+static std::atomic<bool> gTraceEnabled(false);
+static TraceBuffer *gTraceBuffers[kMaxTraceThreads];
+static std::atomic<int> gTraceBufferCount(0);
+static std::atomic<bool> gTraceOverflowWarned(false);
+static thread_local TraceBuffer *tTraceBuffer = nullptr;
+static thread_local bool tTraceDropped = false;
+
+static inline bool TraceEnabled()
+{
+	return gTraceEnabled.load(std::memory_order_relaxed);
+}
+
+static TraceBuffer *TraceThreadBuffer()
+{
+	if (!tTraceBuffer) {
+		if (tTraceDropped)
+			return nullptr;
+		int slot = gTraceBufferCount.fetch_add(1, std::memory_order_relaxed);
+		if (slot >= kMaxTraceThreads) {
+			// Events from threads past the table are dropped; say so once.
+			tTraceDropped = true;
+			if (!gTraceOverflowWarned.exchange(true, std::memory_order_relaxed))
+				printf("trace: more than %d threads, events from thread %d and later ones are dropped\n",
+					kMaxTraceThreads, (int)gettid());
+			return nullptr;
+		}
+		TraceBuffer *buffer = new TraceBuffer;
+		buffer->tid = gettid();
+		snprintf(buffer->threadName, sizeof(buffer->threadName), "thread %d", buffer->tid);
+		buffer->head = 0;
+		gTraceBuffers[slot] = buffer;
+		tTraceBuffer = buffer;
+	}
+	return tTraceBuffer;
+}
+
+///
+// Record an event that started at begin_ns and ends now.
+//
+void TraceComplete(const char *name, const char *category, uint64_t begin_ns)
+{
+	if (!TraceEnabled())
+		return;
+	TraceBuffer *buffer = TraceThreadBuffer();
+	if (!buffer)
+		return;
+	TraceEvent &event = buffer->events[buffer->head++ % kTraceCapacity];
+	event.name = name;
+	event.category = category;
+	event.begin_ns = begin_ns;
+	event.end_ns = NowNs();
+}
+
+void TraceSetThreadName(const char *name)
+{
+	if (!TraceEnabled())
+		return;
+	TraceBuffer *buffer = TraceThreadBuffer();
+	if (buffer)
+		snprintf(buffer->threadName, sizeof(buffer->threadName), "%s", name);
+}
+
+typedef struct TraceScope {
+	const char *name;
+	const char *category;
+	uint64_t begin_ns;
+
+	TraceScope(const char *name, const char *category)
+		: name(name), category(category), begin_ns(TraceEnabled() ? NowNs() : 0) {}
+	~TraceScope()
+	{
+		if (begin_ns)
+			TraceComplete(name, category, begin_ns);
+	}
+} TraceScope;
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Trace the rest of the enclosing block.
+#define TRACE_SCOPE(name, category) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name, category)
+
+bool TraceWriteJSON(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		printf("cannot open %s\n", path);
+		return false;
+	}
+	const int pid = getpid();
+	const int count = std::min(gTraceBufferCount.load(std::memory_order_acquire), kMaxTraceThreads);
+	bool first = true;
+
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (int i = 0; i < count; i++) {
+		const TraceBuffer *buffer = gTraceBuffers[i];
+		fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			first ? "" : ",\n", pid, buffer->tid, buffer->threadName);
+		first = false;
+		uint64_t begin = buffer->head > kTraceCapacity ? buffer->head - kTraceCapacity : 0;
+		for (uint64_t n = begin; n < buffer->head; n++) {
+			const TraceEvent &e = buffer->events[n % kTraceCapacity];
+			fprintf(file, ",\n{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				e.name, e.category, pid, buffer->tid, e.begin_ns / 1e3, (e.end_ns - e.begin_ns) / 1e3);
+		}
+	}
+	fprintf(file, "\n]}\n");
+	return fclose(file) == 0;
+}
+
+///
+// CPU and NUMA placement.
+//
+// A CpuSet is a list of cores from a spec like "0-3,8" or "node1" (all
+// cores of NUMA node 1, read from sysfs). Threads that pin themselves to a
+// set take its cores in turn, one core each. Pixel buffers are allocated
+// and first touched by the thread that uses them, after it is pinned, so
+// the kernel's default local policy places them on that thread's node.
+//
+typedef struct CpuSet {
+	std::vector<int> cpus;
+	std::atomic<unsigned> next;
+} CpuSet;
+
+static CpuSet gPinGL;   // context-owning threads
+static CpuSet gPinCPU;  // encode and I/O threads
+
+static bool ParseCpuRanges(const char *spec, std::vector<int> *cpus)
+{
+	while (*spec && *spec != '\n') {
+		char *end;
+		long first = strtol(spec, &end, 10);
+		long last = first;
+		if (end == spec || first < 0)
+			return false;
+		if (*end == '-') {
+			spec = end + 1;
+			last = strtol(spec, &end, 10);
+			if (end == spec || last < first)
+				return false;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			cpus->push_back((int)cpu);
+		spec = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',' && *end != '\n')
+			return false;
+	}
+	return true;
+}
+
+static bool ReadNodeCpus(int node, std::vector<int> *cpus)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+	FILE *file = fopen(path, "r");
+	if (!file)
+		return false;
+	char line[1024] = "";
+	bool ok = fgets(line, sizeof(line), file) && ParseCpuRanges(line, cpus);
+	fclose(file);
+	return ok;
+}
+
+///
+// NUMA node of a core, or -1 if the system does not report one.
+//
+int CpuNode(int cpu)
+{
+	// Node ids need not be contiguous, so walk the ones that are online
+	std::vector<int> nodes;
+	FILE *file = fopen("/sys/devices/system/node/online", "r");
+	if (!file)
+		return -1;
+	char line[1024] = "";
+	bool ok = fgets(line, sizeof(line), file) && ParseCpuRanges(line, &nodes);
+	fclose(file);
+	for (size_t i = 0; ok && i < nodes.size(); i++) {
+		std::vector<int> cpus;
+		if (ReadNodeCpus(nodes[i], &cpus) && std::find(cpus.begin(), cpus.end(), cpu) != cpus.end())
+			return nodes[i];
+	}
+	return -1;
+}
+
+bool CpuSetParse(CpuSet *set, const char *spec)
+{
+	set->cpus.clear();
+	set->next.store(0);
+	std::string item;
+	for (const char *p = spec; ; p++) {
+		if (*p && *p != ',') {
+			item += *p;
+			continue;
+		}
+		if (item.compare(0, 4, "node") == 0) {
+			const char *digits = item.c_str() + 4;
+			char *end;
+			long node = strtol(digits, &end, 10);
+			if (end == digits || *end || node < 0 || node > INT_MAX) {
+				printf("bad cpu list '%s'\n", spec);
+				return false;
+			}
+			if (!ReadNodeCpus((int)node, &set->cpus)) {
+				printf("no cpus found for NUMA node %ld\n", node);
+				return false;
+			}
+		} else if (!ParseCpuRanges(item.c_str(), &set->cpus)) {
+			printf("bad cpu list '%s'\n", spec);
+			return false;
+		}
+		item.clear();
+		if (!*p)
+			break;
+	}
+	return !set->cpus.empty();
+}
+
+///
+// Pin the calling thread to the next core of set, if it has any.
+//
+void PinThread(CpuSet *set, const char *name)
+{
+	if (set->cpus.empty())
+		return;
+	int cpu = set->cpus[set->next.fetch_add(1) % set->cpus.size()];
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	if (err)
+		printf("cannot pin %s to cpu %d: %s\n", name, cpu, strerror(err));
+	else
+		printf("pinned %s to cpu %d (node %d)\n", name, cpu, CpuNode(cpu));
+}
+
+///
+// Confine the calling thread to all cores of set without taking one of
+// them, for helpers that should stay on the set's node but not displace
+// the threads that get a core each.
+//
+void PinThreadToSet(const CpuSet *set, const char *name)
+{
+	if (set->cpus.empty())
+		return;
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	for (int cpu : set->cpus)
+		CPU_SET(cpu, &mask);
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+	if (err)
+		printf("cannot pin %s: %s\n", name, strerror(err));
+	else
+		printf("pinned %s to %d cpus\n", name, CPU_COUNT(&mask));
+}
+
+///
+// Fence sync objects.
+//
+// EGL_KHR_fence_sync is preferred: an EGLSyncKHR can be waited on from any
+// thread without a current context. When the display does not expose it we
+// fall back to the core ES 3.0 glFenceSync, which is only visible to contexts
+// in the share group of the one that created it.
+//
+typedef enum FenceStatus {
+	FENCE_SIGNALED,
+	FENCE_TIMEOUT,
+	FENCE_ERROR,
+} FenceStatus;
+
+typedef struct GLFence {
+	EGLDisplay dpy;
+	EGLSyncKHR eglSync;
+	GLsync glSync;
+} GLFence;
+
+static PFNEGLCREATESYNCKHRPROC pfnCreateSyncKHR = nullptr;
+static PFNEGLDESTROYSYNCKHRPROC pfnDestroySyncKHR = nullptr;
+static PFNEGLCLIENTWAITSYNCKHRPROC pfnClientWaitSyncKHR = nullptr;
+
+bool InitFenceSync(EGLDisplay dpy)
+{
+	const char *extensions = eglQueryString(dpy, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_KHR_fence_sync")) {
+		printf("EGL_KHR_fence_sync not supported, using glFenceSync\n");
+		return false;
+	}
+	pfnCreateSyncKHR = (PFNEGLCREATESYNCKHRPROC)eglGetProcAddress("eglCreateSyncKHR");
+	pfnDestroySyncKHR = (PFNEGLDESTROYSYNCKHRPROC)eglGetProcAddress("eglDestroySyncKHR");
+	pfnClientWaitSyncKHR = (PFNEGLCLIENTWAITSYNCKHRPROC)eglGetProcAddress("eglClientWaitSyncKHR");
+	if (!pfnCreateSyncKHR || !pfnDestroySyncKHR || !pfnClientWaitSyncKHR) {
+		pfnCreateSyncKHR = nullptr;
+		return false;
+	}
+	return true;
+}
+
+///
+// Insert a fence after all commands issued so far on the current context.
+// The command stream is flushed so that other threads can wait on it.
+//
+GLFence FenceCreate(EGLDisplay dpy)
+{
+	GLFence fence = { dpy, EGL_NO_SYNC_KHR, 0 };
+
+	if (pfnCreateSyncKHR) {
+		fence.eglSync = pfnCreateSyncKHR(dpy, EGL_SYNC_FENCE_KHR, nullptr);
+		assertEGLError("eglCreateSyncKHR");
+	} else {
+		fence.glSync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		assertOpenGLError("glFenceSync");
+	}
+	glFlush();
+	return fence;
+}
+
+///
+// Wait up to timeout_ns for the fence; a timeout of 0 polls without blocking.
+//
+FenceStatus FenceWait(GLFence *fence, uint64_t timeout_ns)
+{
+	if (fence->eglSync != EGL_NO_SYNC_KHR) {
+		EGLint result = pfnClientWaitSyncKHR(fence->dpy, fence->eglSync, 0, timeout_ns);
+		if (result == EGL_CONDITION_SATISFIED_KHR)
+			return FENCE_SIGNALED;
+		return result == EGL_TIMEOUT_EXPIRED_KHR ? FENCE_TIMEOUT : FENCE_ERROR;
+	}
+	if (fence->glSync) {
+		GLenum result = glClientWaitSync(fence->glSync, 0, timeout_ns);
+		if (result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED)
+			return FENCE_SIGNALED;
+		return result == GL_TIMEOUT_EXPIRED ? FENCE_TIMEOUT : FENCE_ERROR;
+	}
+	return FENCE_ERROR;
+}
+
+void FenceDestroy(GLFence *fence)
+{
+	if (fence->eglSync != EGL_NO_SYNC_KHR)
+		pfnDestroySyncKHR(fence->dpy, fence->eglSync);
+	if (fence->glSync)
+		glDeleteSync(fence->glSync);
+	fence->eglSync = EGL_NO_SYNC_KHR;
+	fence->glSync = 0;
+}
+
+///
+// Fence reaper: a thread that watches submitted fences and runs a callback
+// once each one signals or its deadline passes. Callbacks run on the reaper
+// thread and must not touch the submitter's GL context.
+//
+// For glFenceSync fallback fences the reaper owns a 1x1 pbuffer context in the
+// share group of shareContext, so it can only reap fences from that group.
+//
+typedef void (*FenceCallback)(void *userdata, FenceStatus status, uint64_t elapsed_ns);
+
+typedef struct FenceWaiter {
+	GLFence fence;
+	uint64_t submit_ns;
+	uint64_t deadline_ns;
+	FenceCallback callback;
+	void *userdata;
+} FenceWaiter;
+
+typedef struct FenceReaper {
+	EGLDisplay dpy;
+	EGLConfig config;
+	EGLContext shareContext;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<FenceWaiter> pending;
+	bool running;
+} FenceReaper;
+
+static const uint64_t kReaperSliceNs = 1000000;
+
+static void *fence_reaper_func(void *userdata)
+{
+	FenceReaper *reaper = static_cast<FenceReaper *>(userdata);
+	EGLContext context = EGL_NO_CONTEXT;
+	EGLSurface surface = EGL_NO_SURFACE;
+	TraceSetThreadName("fence reaper");
+
+	if (!pfnCreateSyncKHR) {
+		static const GLint contextAttribs[] = {
+			EGL_CONTEXT_CLIENT_VERSION, 3,
+			EGL_NONE
+		};
+		static const EGLint pbufAttribs[] = {
+			EGL_WIDTH, 1,
+			EGL_HEIGHT, 1,
+			EGL_NONE
+		};
+		context = eglCreateContext(reaper->dpy, reaper->config, reaper->shareContext, contextAttribs);
+		assertEGLError("eglCreateContext");
+		surface = eglCreatePbufferSurface(reaper->dpy, reaper->config, pbufAttribs);
+		assertEGLError("eglCreatePbufferSurface");
+		eglMakeCurrent(reaper->dpy, surface, surface, context);
+		assertEGLError("eglMakeCurrent");
+	}
+
+	std::vector<FenceWaiter> waiting;
+	pthread_mutex_lock(&reaper->lock);
+	while (reaper->running || !reaper->pending.empty() || !waiting.empty()) {
+		while (reaper->running && reaper->pending.empty() && waiting.empty())
+			pthread_cond_wait(&reaper->cond, &reaper->lock);
+		waiting.insert(waiting.end(), reaper->pending.begin(), reaper->pending.end());
+		reaper->pending.clear();
+		pthread_mutex_unlock(&reaper->lock);
+
+		// Poll everything once, then block on the oldest fence for a short
+		// slice so the thread sleeps instead of spinning when nothing is done.
+		size_t kept = 0;
+		for (size_t i = 0; i < waiting.size(); i++) {
+			FenceWaiter &w = waiting[i];
+			uint64_t slice = (i == 0) ? kReaperSliceNs : 0;
+			FenceStatus status = FenceWait(&w.fence, slice);
+			uint64_t now = NowNs();
+			if (status == FENCE_TIMEOUT && now < w.deadline_ns) {
+				waiting[kept++] = w;
+				continue;
+			}
+			TraceComplete("gpu job", "gpu", w.submit_ns);
+			w.callback(w.userdata, status, now - w.submit_ns);
+			FenceDestroy(&w.fence);
+			MetricGaugeAdd(&gMetrics.fencesPending, -1);
+		}
+		waiting.resize(kept);
+
+		pthread_mutex_lock(&reaper->lock);
+	}
+	pthread_mutex_unlock(&reaper->lock);
+
+	if (context != EGL_NO_CONTEXT) {
+		eglMakeCurrent(reaper->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		eglDestroySurface(reaper->dpy, surface);
+		eglDestroyContext(reaper->dpy, context);
+	}
+	return 0;
+}
+
+void FenceReaperStart(FenceReaper *reaper, EGLDisplay dpy, EGLConfig config, EGLContext shareContext)
+{
+	reaper->dpy = dpy;
+	reaper->config = config;
+	reaper->shareContext = shareContext;
+	reaper->running = true;
+	pthread_mutex_init(&reaper->lock, NULL);
+	pthread_cond_init(&reaper->cond, NULL);
+	pthread_create(&reaper->thread, NULL, fence_reaper_func, reaper);
+}
+
+///
+// Hand a fence over to the reaper. It takes ownership and destroys the fence
+// after the callback has run. A deadline of 0 means wait forever.
+//
+void FenceReaperSubmit(FenceReaper *reaper, GLFence fence, uint64_t deadline_ns,
+	FenceCallback callback, void *userdata)
+{
+	FenceWaiter waiter;
+	waiter.fence = fence;
+	waiter.submit_ns = NowNs();
+	waiter.deadline_ns = deadline_ns ? waiter.submit_ns + deadline_ns : UINT64_MAX;
+	waiter.callback = callback;
+	waiter.userdata = userdata;
+
+	MetricGaugeAdd(&gMetrics.fencesPending, 1);
+	pthread_mutex_lock(&reaper->lock);
+	reaper->pending.push_back(waiter);
+	pthread_cond_signal(&reaper->cond);
+	pthread_mutex_unlock(&reaper->lock);
+}
+
+///
+// Stop the reaper once every pending fence has been reaped.
+//
+void FenceReaperStop(FenceReaper *reaper)
+{
+	pthread_mutex_lock(&reaper->lock);
+	reaper->running = false;
+	pthread_cond_signal(&reaper->cond);
+	pthread_mutex_unlock(&reaper->lock);
+	pthread_join(reaper->thread, NULL);
+	pthread_mutex_destroy(&reaper->lock);
+	pthread_cond_destroy(&reaper->cond);
+}
+
+///
+// Background asset uploads.
+//
+// An UploadQueue owns a thread with its own context in the workers' share
+// group. It decodes each submitted Asset on the CPU, uploads it, and flips the
+// asset to ASSET_READY behind a fence, so render threads only ever poll and
+// never block on texture I/O. When EGL_KHR_gl_texture_2D_image is available
+// the texture is also exported as an EGLImage for contexts outside the group.
+//
+typedef struct AssetImage {
+	GLsizei width;
+	GLsizei height;
+	std::vector<GLubyte> pixels; // tightly packed RGBA
+} AssetImage;
+
+typedef bool (*AssetDecodeFunc)(void *userdata, AssetImage *image);
+
+typedef enum AssetState {
+	ASSET_PENDING,
+	ASSET_READY,
+	ASSET_FAILED,
+} AssetState;
+
+typedef struct Asset {
+	AssetDecodeFunc decode;
+	void *userdata;
+	std::atomic<int> state;
+	GLuint texture;
+	EGLImageKHR image;
+	GLFence ready;
+} Asset;
+
+typedef struct UploadQueue {
+	EGLDisplay dpy;
+	EGLConfig config;
+	EGLContext shareContext;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<Asset *> pending;
+	bool running;
+} UploadQueue;
+
+static PFNEGLCREATEIMAGEKHRPROC pfnCreateImageKHR = nullptr;
+static PFNEGLDESTROYIMAGEKHRPROC pfnDestroyImageKHR = nullptr;
+
+bool InitEGLImage(EGLDisplay dpy)
+{
+	const char *extensions = eglQueryString(dpy, EGL_EXTENSIONS);
+	if (!extensions || !strstr(extensions, "EGL_KHR_image_base") ||
+			!strstr(extensions, "EGL_KHR_gl_texture_2D_image")) {
+		printf("EGL_KHR_gl_texture_2D_image not supported, sharing by name only\n");
+		return false;
+	}
+	pfnCreateImageKHR = (PFNEGLCREATEIMAGEKHRPROC)eglGetProcAddress("eglCreateImageKHR");
+	pfnDestroyImageKHR = (PFNEGLDESTROYIMAGEKHRPROC)eglGetProcAddress("eglDestroyImageKHR");
+	if (!pfnCreateImageKHR || !pfnDestroyImageKHR) {
+		pfnCreateImageKHR = nullptr;
+		return false;
+	}
+	return true;
+}
+
+static void UploadAsset(UploadQueue *queue, EGLContext context, Asset *asset)
+{
+	AssetImage image = { 0, 0, {} };
+
+	if (!asset->decode(asset->userdata, &image) ||
+			image.pixels.size() < (size_t)image.width * image.height * 4) {
+		asset->state.store(ASSET_FAILED, std::memory_order_release);
+		return;
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glGenTextures(1, &asset->texture);
+	glBindTexture(GL_TEXTURE_2D, asset->texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, image.width, image.height, 0, GL_RGBA,
+		GL_UNSIGNED_BYTE, image.pixels.data());
+	assertOpenGLError("glTexImage2D");
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	asset->image = EGL_NO_IMAGE_KHR;
+	if (pfnCreateImageKHR) {
+		asset->image = pfnCreateImageKHR(queue->dpy, context, EGL_GL_TEXTURE_2D_KHR,
+			(EGLClientBuffer)(uintptr_t)asset->texture, nullptr);
+		assertEGLError("eglCreateImageKHR");
+	}
+
+	asset->ready = FenceCreate(queue->dpy);
+	asset->state.store(ASSET_READY, std::memory_order_release);
+}
+
+static void *upload_thread_func(void *userdata)
+{
+	UploadQueue *queue = static_cast<UploadQueue *>(userdata);
+	TraceSetThreadName("upload");
+	PinThreadToSet(&gPinGL, "upload");
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(queue->dpy, queue->config, queue->shareContext, contextAttribs);
+	assertEGLError("eglCreateContext");
+	EGLSurface surface = eglCreatePbufferSurface(queue->dpy, queue->config, pbufAttribs);
+	assertEGLError("eglCreatePbufferSurface");
+	eglMakeCurrent(queue->dpy, surface, surface, context);
+	assertEGLError("eglMakeCurrent");
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->running || !queue->pending.empty()) {
+		if (queue->pending.empty()) {
+			pthread_cond_wait(&queue->cond, &queue->lock);
+			continue;
+		}
+		Asset *asset = queue->pending.front();
+		queue->pending.erase(queue->pending.begin());
+		pthread_mutex_unlock(&queue->lock);
+
+		{
+			TRACE_SCOPE("upload asset", "upload");
+			UploadAsset(queue, context, asset);
+		}
+		MetricGaugeAdd(&gMetrics.uploadQueueDepth, -1);
+
+		pthread_mutex_lock(&queue->lock);
+	}
+	pthread_mutex_unlock(&queue->lock);
+
+	// Textures outlive this context through the share group and EGLImages
+	eglMakeCurrent(queue->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroySurface(queue->dpy, surface);
+	eglDestroyContext(queue->dpy, context);
+	return 0;
+}
+
+void UploadQueueStart(UploadQueue *queue, EGLDisplay dpy, EGLConfig config, EGLContext shareContext)
+{
+	queue->dpy = dpy;
+	queue->config = config;
+	queue->shareContext = shareContext;
+	queue->running = true;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	pthread_create(&queue->thread, NULL, upload_thread_func, queue);
+}
+
+void UploadQueueSubmit(UploadQueue *queue, Asset *asset)
+{
+	asset->state.store(ASSET_PENDING, std::memory_order_relaxed);
+	asset->texture = 0;
+	asset->image = EGL_NO_IMAGE_KHR;
+
+	MetricGaugeAdd(&gMetrics.uploadQueueDepth, 1);
+	pthread_mutex_lock(&queue->lock);
+	queue->pending.push_back(asset);
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+///
+// Stop the upload thread after draining every submitted asset.
+//
+void UploadQueueStop(UploadQueue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->running = false;
+	pthread_cond_signal(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+	pthread_join(queue->thread, NULL);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->cond);
+}
+
+///
+// Non-blocking: returns the asset's texture once its upload has completed on
+// the GPU, or 0 while it is still in flight (or failed).
+//
+GLuint AssetPoll(Asset *asset)
+{
+	if (asset->state.load(std::memory_order_acquire) != ASSET_READY)
+		return 0;
+	if (FenceWait(&asset->ready, 0) != FENCE_SIGNALED)
+		return 0;
+	return asset->texture;
+}
+
+///
+// Import a ready asset into the current context through its EGLImage. Use
+// this from contexts that are not in the upload queue's share group.
+//
+GLuint AssetImportImage(Asset *asset)
+{
+	if (asset->image == EGL_NO_IMAGE_KHR || !AssetPoll(asset))
+		return 0;
+
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, (GLeglImageOES)asset->image);
+	assertOpenGLError("glEGLImageTargetTexture2DOES");
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	return texture;
+}
+
+///
+// Release an asset. Needs a current context in the upload queue's share group.
+//
+void AssetDestroy(EGLDisplay dpy, Asset *asset)
+{
+	if (asset->state.load(std::memory_order_acquire) != ASSET_READY)
+		return;
+	if (asset->image != EGL_NO_IMAGE_KHR)
+		pfnDestroyImageKHR(dpy, asset->image);
+	FenceDestroy(&asset->ready);
+	glDeleteTextures(1, &asset->texture);
+	asset->texture = 0;
+	asset->image = EGL_NO_IMAGE_KHR;
+}
+
+///
+// Render target pool.
+//
+// Framebuffers with immutable (glTexStorage2D) color attachments, recycled
+// between jobs of the same (width, height, format, samples) instead of being
+// reallocated per job. Framebuffer objects are not shared between contexts,
+// so each worker thread keeps its own pool.
+//
+typedef struct RenderTargetKey {
+	GLsizei width;
+	GLsizei height;
+	GLenum format;  // sized internal format, e.g. GL_RGB8
+	GLsizei samples;
+	GLenum depthStencilFormat; // GL_NONE for no depth/stencil attachment
+} RenderTargetKey;
+
+typedef struct RenderTarget {
+	RenderTargetKey key;
+	GLuint framebuffer;
+	GLuint color; // texture, or renderbuffer when samples > 0
+	GLuint depthStencil; // renderbuffer
+} RenderTarget;
+
+typedef struct RenderTargetPool {
+	std::vector<RenderTarget> free;
+	size_t maxFree;
+} RenderTargetPool;
+
+static bool RenderTargetKeyEqual(const RenderTargetKey &a, const RenderTargetKey &b)
+{
+	return a.width == b.width && a.height == b.height &&
+		a.format == b.format && a.samples == b.samples &&
+		a.depthStencilFormat == b.depthStencilFormat;
+}
+
+static void RenderTargetDestroy(RenderTarget *rt)
+{
+	glDeleteFramebuffers(1, &rt->framebuffer);
+	if (rt->key.samples > 0)
+		glDeleteRenderbuffers(1, &rt->color);
+	else
+		glDeleteTextures(1, &rt->color);
+	if (rt->depthStencil)
+		glDeleteRenderbuffers(1, &rt->depthStencil);
+	rt->framebuffer = 0;
+	rt->color = 0;
+	rt->depthStencil = 0;
+}
+
+static RenderTarget RenderTargetCreate(const RenderTargetKey &key)
+{
+	RenderTarget rt;
+	rt.key = key;
+
+	glGenFramebuffers(1, &rt.framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, rt.framebuffer);
+	assertOpenGLError("glBindFramebuffer");
+
+	if (key.samples > 0) {
+		glGenRenderbuffers(1, &rt.color);
+		glBindRenderbuffer(GL_RENDERBUFFER, rt.color);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, key.samples, key.format, key.width, key.height);
+		assertOpenGLError("glRenderbufferStorageMultisample");
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rt.color);
+		assertOpenGLError("glFramebufferRenderbuffer");
+	} else {
+		glGenTextures(1, &rt.color);
+		glBindTexture(GL_TEXTURE_2D, rt.color);
+		glTexStorage2D(GL_TEXTURE_2D, 1, key.format, key.width, key.height);
+		assertOpenGLError("glTexStorage2D");
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, rt.color, 0);
+		assertOpenGLError("glFramebufferTexture2D");
+	}
+
+	rt.depthStencil = 0;
+	if (key.depthStencilFormat != GL_NONE) {
+		glGenRenderbuffers(1, &rt.depthStencil);
+		glBindRenderbuffer(GL_RENDERBUFFER, rt.depthStencil);
+		glRenderbufferStorageMultisample(GL_RENDERBUFFER, key.samples, key.depthStencilFormat,
+			key.width, key.height);
+		assertOpenGLError("glRenderbufferStorageMultisample");
+		glBindRenderbuffer(GL_RENDERBUFFER, 0);
+		glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rt.depthStencil);
+		assertOpenGLError("glFramebufferRenderbuffer");
+	}
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE)
+		printf("render target %dx%d format %#04x samples %d incomplete: %#04x\n",
+			key.width, key.height, key.format, key.samples, status);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	return rt;
+}
+
+void RenderTargetPoolInit(RenderTargetPool *pool, size_t maxFree)
+{
+	pool->free.clear();
+	pool->maxFree = maxFree;
+}
+
+///
+// Take a render target matching key from the pool, allocating one if none is
+// free. The target's contents are undefined.
+//
+RenderTarget RenderTargetAcquire(RenderTargetPool *pool, const RenderTargetKey &key)
+{
+	for (size_t i = pool->free.size(); i-- > 0; ) {
+		if (RenderTargetKeyEqual(pool->free[i].key, key)) {
+			RenderTarget rt = pool->free[i];
+			pool->free.erase(pool->free.begin() + i);
+			return rt;
+		}
+	}
+	return RenderTargetCreate(key);
+}
+
+///
+// Return a render target to the pool. When the pool is full the least
+// recently released target is destroyed.
+//
+void RenderTargetRelease(RenderTargetPool *pool, RenderTarget rt)
+{
+	if (pool->free.size() >= pool->maxFree && !pool->free.empty()) {
+		RenderTargetDestroy(&pool->free.front());
+		pool->free.erase(pool->free.begin());
+	}
+	pool->free.push_back(rt);
+}
+
+///
+// Make rt's color readable. glReadPixels cannot read a multisampled
+// framebuffer, so those are resolved with glBlitFramebuffer into a
+// single-sample target from pool; release it with RenderTargetReleaseResolved.
+// Single-sample targets are returned unchanged. The result is left bound.
+//
+RenderTarget RenderTargetResolve(RenderTargetPool *pool, const RenderTarget &rt)
+{
+	if (rt.key.samples == 0)
+		return rt;
+	const RenderTargetKey key = { rt.key.width, rt.key.height, rt.key.format, 0, GL_NONE };
+	RenderTarget resolved = RenderTargetAcquire(pool, key);
+	glBindFramebuffer(GL_READ_FRAMEBUFFER, rt.framebuffer);
+	glBindFramebuffer(GL_DRAW_FRAMEBUFFER, resolved.framebuffer);
+	glBlitFramebuffer(0, 0, key.width, key.height, 0, 0, key.width, key.height,
+		GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	assertOpenGLError("glBlitFramebuffer");
+	glBindFramebuffer(GL_FRAMEBUFFER, resolved.framebuffer);
+	return resolved;
+}
+
+void RenderTargetReleaseResolved(RenderTargetPool *pool, const RenderTarget &rt, RenderTarget resolved)
+{
+	if (resolved.framebuffer != rt.framebuffer)
+		RenderTargetRelease(pool, resolved);
+}
+
+void RenderTargetPoolDestroy(RenderTargetPool *pool)
+{
+	for (size_t i = 0; i < pool->free.size(); i++)
+		RenderTargetDestroy(&pool->free[i]);
+	pool->free.clear();
+}
+
+///
+// Render passes.
+//
+// A pass declares what happens to each attachment when rendering starts
+// (keep the old contents, clear them, or don't care) and whether it must be
+// kept once the pass ends. Don't-care attachments are invalidated rather
+// than cleared or preserved, which lets tile-based and software renderers
+// skip loading and storing them. Readback belongs inside the pass.
+//
+typedef enum LoadOp {
+	LOAD_OP_KEEP,
+	LOAD_OP_CLEAR,
+	LOAD_OP_DONT_CARE,
+} LoadOp;
+
+typedef enum StoreOp {
+	STORE_OP_KEEP,
+	STORE_OP_DONT_CARE,
+} StoreOp;
+
+typedef struct RenderPass {
+	LoadOp colorLoad;
+	StoreOp colorStore;
+	LoadOp depthStencilLoad;
+	StoreOp depthStencilStore;
+	GLfloat clearColor[4];
+	GLfloat clearDepth;
+	GLint clearStencil;
+} RenderPass;
+
+static void InvalidateAttachments(const RenderTarget *rt, bool color, bool depthStencil)
+{
+	GLenum attachments[2];
+	GLsizei count = 0;
+
+	if (color)
+		attachments[count++] = GL_COLOR_ATTACHMENT0;
+	if (depthStencil && rt->depthStencil)
+		attachments[count++] = GL_DEPTH_STENCIL_ATTACHMENT;
+	if (count) {
+		glInvalidateFramebuffer(GL_FRAMEBUFFER, count, attachments);
+		assertOpenGLError("glInvalidateFramebuffer");
+	}
+}
+
+///
+// Bind rt and apply the pass's load ops. Leaves the viewport covering rt.
+//
+void RenderPassBegin(const RenderTarget *rt, const RenderPass *pass)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, rt->framebuffer);
+	assertOpenGLError("glBindFramebuffer");
+	glViewport(0, 0, rt->key.width, rt->key.height);
+
+	InvalidateAttachments(rt, pass->colorLoad == LOAD_OP_DONT_CARE,
+		pass->depthStencilLoad == LOAD_OP_DONT_CARE);
+
+	GLbitfield clearMask = 0;
+	if (pass->colorLoad == LOAD_OP_CLEAR) {
+		glClearColor(pass->clearColor[0], pass->clearColor[1], pass->clearColor[2], pass->clearColor[3]);
+		clearMask |= GL_COLOR_BUFFER_BIT;
+	}
+	if (rt->depthStencil && pass->depthStencilLoad == LOAD_OP_CLEAR) {
+		glClearDepthf(pass->clearDepth);
+		glClearStencil(pass->clearStencil);
+		clearMask |= GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT;
+	}
+	if (clearMask)
+		glClear(clearMask);
+}
+
+///
+// Apply the pass's store ops and unbind rt.
+//
+void RenderPassEnd(const RenderTarget *rt, const RenderPass *pass)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, rt->framebuffer);
+	InvalidateAttachments(rt, pass->colorStore == STORE_OP_DONT_CARE,
+		pass->depthStencilStore == STORE_OP_DONT_CARE);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+///
+// Content hashing.
+//
+// xxHash64. The four accumulators are independent, so their multiplies
+// overlap in the pipeline; SSE2 has no 64-bit multiply, so the lanes stay
+// in scalar registers.
+//
+static const uint64_t kXXHPrime1 = 11400714785074694791ull;
+static const uint64_t kXXHPrime2 = 14029467366897019727ull;
+static const uint64_t kXXHPrime3 = 1609587929392839161ull;
+static const uint64_t kXXHPrime4 = 9650029242287828579ull;
+static const uint64_t kXXHPrime5 = 2870177450012600261ull;
+
+static inline uint64_t XXHRotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t XXHRead64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t XXHRound(uint64_t acc, uint64_t input)
+{
+	acc += input * kXXHPrime2;
+	return XXHRotl(acc, 31) * kXXHPrime1;
+}
+
+static inline uint64_t XXHMerge(uint64_t acc, uint64_t lane)
+{
+	acc ^= XXHRound(0, lane);
+	return acc * kXXHPrime1 + kXXHPrime4;
+}
+
+uint64_t HashBytes(const void *data, size_t size, uint64_t seed = 0)
+{
+	const uint8_t *p = static_cast<const uint8_t *>(data);
+	const uint8_t *end = p + size;
+	uint64_t h;
+
+	if (size >= 32) {
+		uint64_t v1 = seed + kXXHPrime1 + kXXHPrime2;
+		uint64_t v2 = seed + kXXHPrime2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - kXXHPrime1;
+		do {
+			v1 = XXHRound(v1, XXHRead64(p));
+			v2 = XXHRound(v2, XXHRead64(p + 8));
+			v3 = XXHRound(v3, XXHRead64(p + 16));
+			v4 = XXHRound(v4, XXHRead64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = XXHRotl(v1, 1) + XXHRotl(v2, 7) + XXHRotl(v3, 12) + XXHRotl(v4, 18);
+		h = XXHMerge(h, v1);
+		h = XXHMerge(h, v2);
+		h = XXHMerge(h, v3);
+		h = XXHMerge(h, v4);
+	} else {
+		h = seed + kXXHPrime5;
+	}
+
+	h += size;
+	for (; p + 8 <= end; p += 8) {
+		h ^= XXHRound(0, XXHRead64(p));
+		h = XXHRotl(h, 27) * kXXHPrime1 + kXXHPrime4;
+	}
+	if (p + 4 <= end) {
+		uint32_t v;
+		memcpy(&v, p, sizeof(v));
+		h ^= (uint64_t)v * kXXHPrime1;
+		h = XXHRotl(h, 23) * kXXHPrime2 + kXXHPrime3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * kXXHPrime5;
+		h = XXHRotl(h, 11) * kXXHPrime1;
+	}
+
+	h ^= h >> 33;
+	h *= kXXHPrime2;
+	h ^= h >> 29;
+	h *= kXXHPrime3;
+	h ^= h >> 32;
+	return h;
+}
+
+///
+// Frame deduplication.
+//
+// Recently encoded frames keyed by content hash, most recent first. A frame
+// identical to the last one saved is not written again; one matching an
+// older entry reuses its encoded bytes instead of running the encoder.
+//
+typedef struct EncodedFrame {
+	uint64_t hash;
+	std::vector<unsigned char> bytes;
+} EncodedFrame;
+
+typedef struct EncodeCache {
+	std::vector<EncodedFrame> entries;
+	size_t capacity;
+	bool hasLast;
+	uint64_t lastSaved;
+} EncodeCache;
+
+typedef enum SaveResult {
+	SAVE_WRITTEN,
+	SAVE_REUSED,
+	SAVE_UNCHANGED,
+	SAVE_FAILED,
+} SaveResult;
+
+void EncodeCacheInit(EncodeCache *cache, size_t capacity)
+{
+	cache->entries.clear();
+	cache->capacity = capacity;
+	cache->hasLast = false;
+	cache->lastSaved = 0;
+}
+
+static bool WriteFile(const char *path, const void *data, size_t size)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file)
+		return false;
+	bool ok = fwrite(data, 1, size, file) == size;
+	return fclose(file) == 0 && ok;
+}
+
+///
+// Save an image as PNG at path, skipping the encoder and the write where the
+// cache allows. A cache with capacity 0 always encodes and writes.
+//
+SaveResult SavePNGCached(EncodeCache *cache, const char *path, int width, int height, int comp,
+	const void *data, int stride)
+{
+	if (cache->capacity == 0)
+		return stbi_write_png(path, width, height, comp, data, stride) ? SAVE_WRITTEN : SAVE_FAILED;
+
+	uint64_t hash = HashBytes(data, (size_t)stride * height);
+	if (cache->hasLast && cache->lastSaved == hash)
+		return SAVE_UNCHANGED;
+
+	SaveResult result = SAVE_REUSED;
+	size_t i = 0;
+	while (i < cache->entries.size() && cache->entries[i].hash != hash)
+		i++;
+	if (i == cache->entries.size()) {
+		int len = 0;
+		unsigned char *png = stbi_write_png_to_mem((const unsigned char *)data, stride,
+			width, height, comp, &len);
+		if (!png)
+			return SAVE_FAILED;
+		EncodedFrame entry;
+		entry.hash = hash;
+		entry.bytes.assign(png, png + len);
+		STBIW_FREE(png);
+		if (cache->entries.size() >= cache->capacity)
+			cache->entries.pop_back();
+		cache->entries.insert(cache->entries.begin(), std::move(entry));
+		result = SAVE_WRITTEN;
+	} else if (i > 0) {
+		std::rotate(cache->entries.begin(), cache->entries.begin() + i, cache->entries.begin() + i + 1);
+	}
+
+	const std::vector<unsigned char> &bytes = cache->entries.front().bytes;
+	if (!WriteFile(path, bytes.data(), bytes.size())) {
+		cache->hasLast = false;
+		return SAVE_FAILED;
+	}
+	cache->hasLast = true;
+	cache->lastSaved = hash;
+	return result;
+}
+
+///
+// RGBA to YUV 4:2:0 conversion.
+//
+// Full-range BT.601 (what Y4M calls C420jpeg) in 8.8 fixed point. Input rows
+// are in glReadPixels order, bottom row first; output planes are top-down.
+// Width and height must be even.
+//
+static const int kYCoef[3] = { 77, 150, 29 };
+static const int kUCoef[3] = { -43, -85, 128 };
+static const int kVCoef[3] = { 128, -107, -21 };
+
+static inline uint8_t ClampU8(int v)
+{
+	return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline int Dot3(const uint8_t *px, const int *coef)
+{
+	return coef[0] * px[0] + coef[1] * px[1] + coef[2] * px[2];
+}
+
+#if defined(__SSE2__)
+// Weighted sum of R, G, B for four RGBA pixels, as four 32-bit lanes.
+static inline __m128i Dot4x4(__m128i px, __m128i coef)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coef);
+	__m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coef);
+	__m128 even = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0));
+	__m128 odd = _mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1));
+	return _mm_add_epi32(_mm_castps_si128(even), _mm_castps_si128(odd));
+}
+
+static inline __m128i CoefVector(const int *coef)
+{
+	return _mm_setr_epi16(coef[0], coef[1], coef[2], 0, coef[0], coef[1], coef[2], 0);
+}
+
+// (sum + bias) >> 8 for 16 lanes, saturated to bytes.
+static inline __m128i PackU8(__m128i a, __m128i b, __m128i c, __m128i d, __m128i bias)
+{
+	a = _mm_srai_epi32(_mm_add_epi32(a, bias), 8);
+	b = _mm_srai_epi32(_mm_add_epi32(b, bias), 8);
+	c = _mm_srai_epi32(_mm_add_epi32(c, bias), 8);
+	d = _mm_srai_epi32(_mm_add_epi32(d, bias), 8);
+	return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+#endif
+
+static void ConvertRowY(const uint8_t *src, uint8_t *dst, int width)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i coef = CoefVector(kYCoef);
+	const __m128i bias = _mm_set1_epi32(128);
+	for (; x + 16 <= width; x += 16) {
+		const __m128i *p = (const __m128i *)(src + x * 4);
+		__m128i y = PackU8(Dot4x4(_mm_loadu_si128(p), coef), Dot4x4(_mm_loadu_si128(p + 1), coef),
+			Dot4x4(_mm_loadu_si128(p + 2), coef), Dot4x4(_mm_loadu_si128(p + 3), coef), bias);
+		_mm_storeu_si128((__m128i *)(dst + x), y);
+	}
+#endif
+	for (; x < width; x++)
+		dst[x] = ClampU8((Dot3(src + x * 4, kYCoef) + 128) >> 8);
+}
+
+static void ConvertRowUV(const uint8_t *row0, const uint8_t *row1, uint8_t *u, uint8_t *v, int width)
+{
+	int x = 0;
+#if defined(__SSE2__)
+	const __m128i ucoef = CoefVector(kUCoef);
+	const __m128i vcoef = CoefVector(kVCoef);
+	const __m128i bias = _mm_set1_epi32((128 << 8) + 128);
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i two = _mm_set1_epi16(2);
+	for (; x + 8 <= width; x += 8) {
+		// Sum each 2x2 block in 16-bit lanes and round like the scalar
+		// path: (sum + 2) >> 2
+		const __m128i r0a = _mm_loadu_si128((const __m128i *)(row0 + x * 4));
+		const __m128i r0b = _mm_loadu_si128((const __m128i *)(row0 + x * 4 + 16));
+		const __m128i r1a = _mm_loadu_si128((const __m128i *)(row1 + x * 4));
+		const __m128i r1b = _mm_loadu_si128((const __m128i *)(row1 + x * 4 + 16));
+		__m128i s0 = _mm_add_epi16(_mm_unpacklo_epi8(r0a, zero), _mm_unpacklo_epi8(r1a, zero));
+		__m128i s1 = _mm_add_epi16(_mm_unpackhi_epi8(r0a, zero), _mm_unpackhi_epi8(r1a, zero));
+		__m128i s2 = _mm_add_epi16(_mm_unpacklo_epi8(r0b, zero), _mm_unpacklo_epi8(r1b, zero));
+		__m128i s3 = _mm_add_epi16(_mm_unpackhi_epi8(r0b, zero), _mm_unpackhi_epi8(r1b, zero));
+		__m128i b01 = _mm_add_epi16(_mm_unpacklo_epi64(s0, s1), _mm_unpackhi_epi64(s0, s1));
+		__m128i b23 = _mm_add_epi16(_mm_unpacklo_epi64(s2, s3), _mm_unpackhi_epi64(s2, s3));
+		b01 = _mm_srli_epi16(_mm_add_epi16(b01, two), 2);
+		b23 = _mm_srli_epi16(_mm_add_epi16(b23, two), 2);
+		__m128i px = _mm_packus_epi16(b01, b23);
+		__m128i uu = PackU8(Dot4x4(px, ucoef), zero, zero, zero, bias);
+		__m128i vv = PackU8(Dot4x4(px, vcoef), zero, zero, zero, bias);
+		int ui = _mm_cvtsi128_si32(uu);
+		int vi = _mm_cvtsi128_si32(vv);
+		memcpy(u + x / 2, &ui, 4);
+		memcpy(v + x / 2, &vi, 4);
+	}
+#endif
+	for (; x < width; x += 2) {
+		uint8_t px[3];
+		for (int c = 0; c < 3; c++)
+			px[c] = (row0[x * 4 + c] + row0[x * 4 + 4 + c] + row1[x * 4 + c] + row1[x * 4 + 4 + c] + 2) >> 2;
+		u[x / 2] = ClampU8((Dot3(px, kUCoef) + (128 << 8) + 128) >> 8);
+		v[x / 2] = ClampU8((Dot3(px, kVCoef) + (128 << 8) + 128) >> 8);
+	}
+}
+
+///
+// Convert a bottom-up RGBA image into top-down planar I420 (Y, then U, then V).
+//
+void ConvertRGBAToI420(const uint8_t *rgba, int stride, int width, int height, uint8_t *yuv)
+{
+	uint8_t *yPlane = yuv;
+	uint8_t *uPlane = yPlane + width * height;
+	uint8_t *vPlane = uPlane + (width / 2) * (height / 2);
+
+	for (int y = 0; y < height; y++)
+		ConvertRowY(rgba + (size_t)(height - 1 - y) * stride, yPlane + (size_t)y * width, width);
+	for (int y = 0; y < height / 2; y++) {
+		const uint8_t *row0 = rgba + (size_t)(height - 1 - 2 * y) * stride;
+		const uint8_t *row1 = row0 - stride;
+		ConvertRowUV(row0, row1, uPlane + (size_t)y * (width / 2), vPlane + (size_t)y * (width / 2), width);
+	}
+}
+
+///
+// GPU YUV conversion.
+//
+// Converts a rendered RGB texture into planar YUV 4:2:0 on the GPU so that
+// readback moves 1.5 bytes per pixel instead of 4. Each plane is rendered
+// into an RGBA8 target that packs four consecutive 8-bit samples per texel,
+// which keeps readback on the always-supported GL_RGBA/GL_UNSIGNED_BYTE
+// path. Output is top-down I420 or NV12, matching ConvertRGBAToI420.
+//
+typedef enum YUVLayout {
+	YUV_I420,
+	YUV_NV12,
+} YUVLayout;
+
+typedef struct YUVConverter {
+	GLuint yProgram;
+	GLuint uvProgram;
+	GLint ySrcLoc;
+	GLint yHeightLoc;
+	GLint uvSrcLoc;
+	GLint uvHeightLoc;
+	GLint uvModeLoc;
+	GLuint vao;
+} YUVConverter;
+
+static const char kYUVVertexShader[] = R"(#version 300 es
+void main()
+{
+    // Full-screen triangle
+    vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+    gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+})";
+
+static const char kYFragmentShader[] = R"(#version 300 es
+precision highp float;
+precision highp int;
+uniform sampler2D s_src;
+uniform int u_height;
+out vec4 fragColor;
+const vec3 kY = vec3(0.299, 0.587, 0.114);
+float luma(int x, int y)
+{
+    return dot(texelFetch(s_src, ivec2(x, y), 0).rgb, kY);
+}
+void main()
+{
+    ivec2 o = ivec2(gl_FragCoord.xy);
+    int x = o.x * 4;
+    int y = u_height - 1 - o.y;
+    fragColor = vec4(luma(x, y), luma(x + 1, y), luma(x + 2, y), luma(x + 3, y));
+})";
+
+// u_mode 0 packs four U samples, 1 four V samples, 2 interleaved U V U V.
+static const char kUVFragmentShader[] = R"(#version 300 es
+precision highp float;
+precision highp int;
+uniform sampler2D s_src;
+uniform int u_height;
+uniform int u_mode;
+out vec4 fragColor;
+const vec3 kU = vec3(-0.168736, -0.331264, 0.5);
+const vec3 kV = vec3(0.5, -0.418688, -0.081312);
+const float kBias = 128.0 / 255.0;
+vec3 block(int cx, int cy)
+{
+    int x = cx * 2;
+    int y = u_height - 1 - cy * 2;
+    return 0.25 * (texelFetch(s_src, ivec2(x, y), 0).rgb +
+                   texelFetch(s_src, ivec2(x + 1, y), 0).rgb +
+                   texelFetch(s_src, ivec2(x, y - 1), 0).rgb +
+                   texelFetch(s_src, ivec2(x + 1, y - 1), 0).rgb);
+}
+void main()
+{
+    ivec2 o = ivec2(gl_FragCoord.xy);
+    if (u_mode == 2) {
+        vec3 a = block(o.x * 2, o.y);
+        vec3 b = block(o.x * 2 + 1, o.y);
+        fragColor = vec4(dot(a, kU), dot(a, kV), dot(b, kU), dot(b, kV)) + kBias;
+        return;
+    }
+    vec3 k = (u_mode == 0) ? kU : kV;
+    int cx = o.x * 4;
+    fragColor = vec4(dot(block(cx, o.y), k), dot(block(cx + 1, o.y), k),
+                     dot(block(cx + 2, o.y), k), dot(block(cx + 3, o.y), k)) + kBias;
+})";
+
+bool YUVConverterInit(YUVConverter *conv)
+{
+	conv->yProgram = CompileProgram(kYUVVertexShader, kYFragmentShader);
+	conv->uvProgram = CompileProgram(kYUVVertexShader, kUVFragmentShader);
+	if (!conv->yProgram || !conv->uvProgram)
+		return false;
+	conv->ySrcLoc = glGetUniformLocation(conv->yProgram, "s_src");
+	conv->yHeightLoc = glGetUniformLocation(conv->yProgram, "u_height");
+	conv->uvSrcLoc = glGetUniformLocation(conv->uvProgram, "s_src");
+	conv->uvHeightLoc = glGetUniformLocation(conv->uvProgram, "u_height");
+	conv->uvModeLoc = glGetUniformLocation(conv->uvProgram, "u_mode");
+	// An empty VAO, so the pass never sees a caller's client-side arrays
+	glGenVertexArrays(1, &conv->vao);
+	return true;
+}
+
+void YUVConverterDestroy(YUVConverter *conv)
+{
+	glDeleteProgram(conv->yProgram);
+	glDeleteProgram(conv->uvProgram);
+	glDeleteVertexArrays(1, &conv->vao);
+}
+
+static void YUVConvertPlane(RenderTargetPool *pool, GLsizei texelWidth, GLsizei rows, uint8_t *out)
+{
+	const RenderTargetKey key = { texelWidth, rows, GL_RGBA8, 0, GL_NONE };
+	const RenderPass pass = {
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		{ 0.0f, 0.0f, 0.0f, 0.0f }, 1.0f, 0,
+	};
+	RenderTarget plane = RenderTargetAcquire(pool, key);
+
+	RenderPassBegin(&plane, &pass);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glReadPixels(0, 0, texelWidth, rows, GL_RGBA, GL_UNSIGNED_BYTE, out);
+	assertOpenGLError("glReadPixels");
+	RenderPassEnd(&plane, &pass);
+	RenderTargetRelease(pool, plane);
+}
+
+///
+// Convert the RGB texture src (width x height, bottom row first) and read it
+// back into out, which must hold width * height * 3 / 2 bytes. width must be a
+// multiple of 8 and height even. Leaves the framebuffer binding at 0.
+//
+bool YUVConvertAndRead(YUVConverter *conv, RenderTargetPool *pool, GLuint src,
+	GLsizei width, GLsizei height, YUVLayout layout, uint8_t *out)
+{
+	if ((width % 8) || (height % 2)) {
+		printf("GPU YUV conversion needs width %% 8 == 0 and even height, got %dx%d\n", width, height);
+		return false;
+	}
+
+	glBindVertexArray(conv->vao);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, src);
+
+	glUseProgram(conv->yProgram);
+	glUniform1i(conv->ySrcLoc, 0);
+	glUniform1i(conv->yHeightLoc, height);
+	YUVConvertPlane(pool, width / 4, height, out);
+	out += (size_t)width * height;
+
+	glUseProgram(conv->uvProgram);
+	glUniform1i(conv->uvSrcLoc, 0);
+	glUniform1i(conv->uvHeightLoc, height);
+	if (layout == YUV_NV12) {
+		glUniform1i(conv->uvModeLoc, 2);
+		YUVConvertPlane(pool, width / 4, height / 2, out);
+	} else {
+		glUniform1i(conv->uvModeLoc, 0);
+		YUVConvertPlane(pool, width / 8, height / 2, out);
+		glUniform1i(conv->uvModeLoc, 1);
+		YUVConvertPlane(pool, width / 8, height / 2, out + (size_t)width * height / 4);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glBindVertexArray(0);
+	return true;
+}
+
+///
+// Streaming frame sink.
+//
+// Appends frames to a YUV4MPEG2, raw RGBA or raw NV12 stream on stdout or
+// any path, typically a named pipe created with mkfifo, for an external
+// encoder to consume. Writing to stdout moves the program's own logging to
+// stderr.
+//
+typedef enum SinkFormat {
+	SINK_Y4M,
+	SINK_RGBA,
+	SINK_NV12,
+} SinkFormat;
+
+typedef struct FrameSink {
+	FILE *file;
+	SinkFormat format;
+	int width;
+	int height;
+	int fps;
+	bool dedupe;      // skip conversion when a frame repeats the last one
+	bool hasLast;
+	uint64_t lastHash;
+	std::vector<uint8_t> frame;
+	pthread_mutex_t lock;
+} FrameSink;
+
+static int gSinkStdout = -1;  // the real stdout, once logging has moved off it
+
+///
+// Keep stdout for a stream and move the program's own logging to stderr.
+// Call it before anything is printed so the stream starts with its header.
+//
+void FrameSinkClaimStdout()
+{
+	if (gSinkStdout >= 0)
+		return;
+	fflush(stdout);
+	gSinkStdout = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+bool FrameSinkOpen(FrameSink *sink, const char *path, SinkFormat format, int width, int height, int fps)
+{
+	if (format != SINK_RGBA && ((width | height) & 1)) {
+		printf("yuv stream needs an even frame size, got %dx%d\n", width, height);
+		return false;
+	}
+
+	if (strcmp(path, "-") == 0) {
+		FrameSinkClaimStdout();
+		sink->file = fdopen(gSinkStdout, "wb");
+		gSinkStdout = -1;
+	} else {
+		sink->file = fopen(path, "wb");
+	}
+	if (!sink->file) {
+		printf("failed to open stream %s\n", path);
+		return false;
+	}
+	// A consumer going away must end the stream, not the process
+	signal(SIGPIPE, SIG_IGN);
+
+	sink->format = format;
+	sink->width = width;
+	sink->height = height;
+	sink->fps = fps;
+	sink->dedupe = false;
+	sink->hasLast = false;
+	sink->lastHash = 0;
+	pthread_mutex_init(&sink->lock, NULL);
+	if (format == SINK_RGBA)
+		sink->frame.resize((size_t)width * height * 4);
+	else
+		sink->frame.resize((size_t)width * height * 3 / 2);
+	if (format == SINK_Y4M)
+		fprintf(sink->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg\n", width, height, fps);
+	return true;
+}
+
+///
+// The plane layout FrameSinkWriteYUV expects for a YUV sink.
+//
+YUVLayout FrameSinkLayout(const FrameSink *sink)
+{
+	return sink->format == SINK_NV12 ? YUV_NV12 : YUV_I420;
+}
+
+static bool FrameSinkEmit(FrameSink *sink, const uint8_t *data)
+{
+	if (sink->format == SINK_Y4M)
+		fputs("FRAME\n", sink->file);
+	bool ok = fwrite(data, 1, sink->frame.size(), sink->file) == sink->frame.size();
+	return ok && fflush(sink->file) == 0;
+}
+
+///
+// Append a frame that is already top-down YUV in FrameSinkLayout(sink),
+// e.g. from YUVConvertAndRead.
+//
+bool FrameSinkWriteYUV(FrameSink *sink, const uint8_t *yuv)
+{
+	pthread_mutex_lock(&sink->lock);
+	bool ok = FrameSinkEmit(sink, yuv);
+	pthread_mutex_unlock(&sink->lock);
+	return ok;
+}
+
+///
+// Append one frame read back with glReadPixels (RGBA, bottom row first).
+// Returns false once the stream can no longer be written.
+//
+bool FrameSinkWrite(FrameSink *sink, const uint8_t *rgba, int stride)
+{
+	const int width = sink->width;
+	const int height = sink->height;
+
+	pthread_mutex_lock(&sink->lock);
+	if (sink->dedupe) {
+		// A repeat of the last frame re-emits the converted bytes as they are
+		uint64_t hash = HashBytes(rgba, (size_t)stride * height);
+		if (sink->hasLast && hash == sink->lastHash) {
+			bool ok = FrameSinkEmit(sink, sink->frame.data());
+			pthread_mutex_unlock(&sink->lock);
+			return ok;
+		}
+		sink->hasLast = true;
+		sink->lastHash = hash;
+	}
+	if (sink->format == SINK_RGBA) {
+		for (int y = 0; y < height; y++)
+			memcpy(&sink->frame[(size_t)y * width * 4], rgba + (size_t)(height - 1 - y) * stride, width * 4);
+	} else {
+		ConvertRGBAToI420(rgba, stride, width, height, sink->frame.data());
+	}
+	if (sink->format == SINK_NV12) {
+		// Interleave the U and V planes in place of I420's separate ones
+		size_t chroma = (size_t)width * height / 4;
+		uint8_t *u = &sink->frame[(size_t)width * height];
+		std::vector<uint8_t> uv(chroma * 2);
+		for (size_t i = 0; i < chroma; i++) {
+			uv[i * 2] = u[i];
+			uv[i * 2 + 1] = u[chroma + i];
+		}
+		memcpy(u, uv.data(), uv.size());
+	}
+	bool ok = FrameSinkEmit(sink, sink->frame.data());
+	pthread_mutex_unlock(&sink->lock);
+	return ok;
+}
+
+void FrameSinkClose(FrameSink *sink)
+{
+	fclose(sink->file);
+	sink->file = nullptr;
+	pthread_mutex_destroy(&sink->lock);
+}
+
+///
+// Shared-memory frame ring.
+//
+// Raw RGBA frames are published into a POSIX shared memory object that
+// consumers on the same host map read-only, so nothing is encoded or copied
+// on the way. The object holds a header followed by `slots` page-aligned
+// slots; frame n (counting from 1) goes to slot (n - 1) % slots.
+//
+// Each slot is a seqlock: the writer marks it busy, fills it and then
+// stores n, and publishes n in the header. A consumer reads the slot's seq,
+// uses the pixels in place and re-reads the seq; if it changed, the writer
+// lapped the consumer and the frame must be dropped. The writer never waits.
+//
+static const uint32_t kFrameRingMagic = 0x474e5246;  // "FRNG"
+static const uint32_t kFrameRingVersion = 1;
+static const uint64_t kFrameSlotBusy = UINT64_MAX;
+static const size_t kFrameRingAlign = 4096;
+
+typedef struct FrameRingHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;      // bytes per row; rows are bottom-up as read back
+	uint64_t slotSize;    // bytes from one slot to the next
+	uint64_t dataOffset;  // from the start of a slot to its pixels
+	std::atomic<uint64_t> writeSeq;  // last published frame, 0 for none
+	std::atomic<uint32_t> closed;    // set once the producer is done
+} FrameRingHeader;
+
+typedef struct FrameSlotHeader {
+	std::atomic<uint64_t> seq;
+	uint64_t timestamp_ns;  // CLOCK_MONOTONIC time of publication
+} FrameSlotHeader;
+
+typedef struct FrameRing {
+	char name[64];
+	uint8_t *base;
+	size_t size;
+	bool owner;
+	uint64_t nextSeq;  // producer side: frame being written
+	// Geometry, checked once at open; the header copy is not trusted after
+	uint32_t slots;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint64_t slotSize;
+	uint64_t dataOffset;
+} FrameRing;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring atomics must be address-free");
+
+static inline FrameSlotHeader *FrameRingSlot(const FrameRing *ring, uint64_t seq)
+{
+	return (FrameSlotHeader *)(ring->base + kFrameRingAlign + ((seq - 1) % ring->slots) * ring->slotSize);
+}
+
+///
+// Create the shared memory object `name`, e.g. "/frames". Fails if the name
+// is taken, so a live ring of another producer is never replaced; a ring
+// left behind by a crashed producer has to be removed from /dev/shm first.
+//
+bool FrameRingCreate(FrameRing *ring, const char *name, uint32_t slots, uint32_t width, uint32_t height)
+{
+	const uint32_t stride = width * 4;
+	const uint64_t dataOffset = 64;
+	const uint64_t slotSize = (dataOffset + (uint64_t)stride * height + kFrameRingAlign - 1) /
+		kFrameRingAlign * kFrameRingAlign;
+
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->size = kFrameRingAlign + slotSize * slots;
+	ring->owner = true;
+	ring->nextSeq = 1;
+	ring->slots = slots;
+	ring->width = width;
+	ring->height = height;
+	ring->stride = stride;
+	ring->slotSize = slotSize;
+	ring->dataOffset = dataOffset;
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		printf("shared memory %s already exists; another producer may be using it\n", name);
+		return false;
+	}
+	if (fd < 0 || ftruncate(fd, ring->size) != 0) {
+		printf("cannot create shared memory %s: %s\n", name, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			shm_unlink(name);
+		}
+		return false;
+	}
+	void *p = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		return false;
+	}
+	ring->base = (uint8_t *)p;
+
+	FrameRingHeader *header = new (ring->base) FrameRingHeader;
+	header->version = kFrameRingVersion;
+	header->slots = slots;
+	header->width = width;
+	header->height = height;
+	header->stride = stride;
+	header->slotSize = slotSize;
+	header->dataOffset = dataOffset;
+	header->writeSeq.store(0, std::memory_order_relaxed);
+	header->closed.store(0, std::memory_order_relaxed);
+	for (uint64_t seq = 1; seq <= slots; seq++)
+		new (FrameRingSlot(ring, seq)) FrameSlotHeader{ {0}, 0 };
+	// Consumers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = kFrameRingMagic;
+	return true;
+}
+
+///
+// Claim the next slot and return where its pixels go. The slot is marked
+// busy until FrameRingPublish.
+//
+uint8_t *FrameRingBegin(FrameRing *ring)
+{
+	FrameSlotHeader *slot = FrameRingSlot(ring, ring->nextSeq);
+	slot->seq.store(kFrameSlotBusy, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	return (uint8_t *)slot + ring->dataOffset;
+}
+
+void FrameRingPublish(FrameRing *ring)
+{
+	FrameRingHeader *header = (FrameRingHeader *)ring->base;
+	FrameSlotHeader *slot = FrameRingSlot(ring, ring->nextSeq);
+	slot->timestamp_ns = NowNs();
+	slot->seq.store(ring->nextSeq, std::memory_order_release);
+	header->writeSeq.store(ring->nextSeq, std::memory_order_release);
+	ring->nextSeq++;
+}
+
+///
+// Map an existing ring read-only.
+//
+bool FrameRingOpen(FrameRing *ring, const char *name)
+{
+	snprintf(ring->name, sizeof(ring->name), "%s", name);
+	ring->owner = false;
+	int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < kFrameRingAlign) {
+		printf("cannot open shared memory %s: %s\n", name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	ring->size = st.st_size;
+	void *p = mmap(NULL, ring->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return false;
+	ring->base = (uint8_t *)p;
+
+	const FrameRingHeader *header = (const FrameRingHeader *)ring->base;
+	bool valid = header->magic == kFrameRingMagic && header->version == kFrameRingVersion;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (valid) {
+		ring->slots = header->slots;
+		ring->width = header->width;
+		ring->height = header->height;
+		ring->stride = header->stride;
+		ring->slotSize = header->slotSize;
+		ring->dataOffset = header->dataOffset;
+		// Every slot, and the pixels inside it, must lie within the mapping
+		valid = ring->slots && ring->width && ring->height &&
+			ring->stride >= (uint64_t)ring->width * 4 &&
+			ring->dataOffset >= sizeof(FrameSlotHeader) && ring->dataOffset <= ring->slotSize &&
+			(uint64_t)ring->stride * ring->height <= ring->slotSize - ring->dataOffset &&
+			ring->slotSize <= (ring->size - kFrameRingAlign) / ring->slots;
+	}
+	if (!valid) {
+		printf("%s is not a frame ring\n", name);
+		munmap(ring->base, ring->size);
+		return false;
+	}
+	return true;
+}
+
+///
+// Mark the ring finished and unmap it; the owner also removes the name.
+//
+void FrameRingClose(FrameRing *ring)
+{
+	if (ring->owner) {
+		((FrameRingHeader *)ring->base)->closed.store(1, std::memory_order_release);
+		shm_unlink(ring->name);
+	}
+	munmap(ring->base, ring->size);
+}
+
+///
+// Consume frames from the ring named `name` until the producer closes it
+// or `limit` frames (0 for no limit) were seen. Frames are used in place:
+// each one is hashed, standing in for a real consumer, and the newest one
+// is saved to savePath if given.
+//
+bool FrameRingConsume(const char *name, int limit, const char *savePath)
+{
+	FrameRing ring;
+	if (!FrameRingOpen(&ring, name))
+		return false;
+	const FrameRingHeader *header = (const FrameRingHeader *)ring.base;
+	printf("consuming %s: %u slots of %ux%u\n", name, ring.slots, ring.width, ring.height);
+
+	uint64_t lastSeq = header->writeSeq.load(std::memory_order_acquire);
+	uint64_t consumed = 0, dropped = 0, latency_ns = 0, checksum = 0;
+	const size_t size = (size_t)ring.stride * ring.height;
+	std::vector<uint8_t> saved, scratch;
+	while (!limit || consumed < (uint64_t)limit) {
+		uint64_t seq = header->writeSeq.load(std::memory_order_acquire);
+		if (seq == lastSeq) {
+			if (header->closed.load(std::memory_order_acquire))
+				break;
+			usleep(500);
+			continue;
+		}
+		// Catch up to the oldest frame still in the ring
+		uint64_t next = lastSeq + 1;
+		if (seq - next >= ring.slots) {
+			dropped += seq - ring.slots + 1 - next;
+			next = seq - ring.slots + 1;
+		}
+		for (; next <= seq; next++) {
+			const FrameSlotHeader *slot = FrameRingSlot(&ring, next);
+			if (slot->seq.load(std::memory_order_acquire) != next) {
+				dropped++;
+				continue;
+			}
+			const uint8_t *pixels = (const uint8_t *)slot + ring.dataOffset;
+			uint64_t published = slot->timestamp_ns;
+			uint64_t hash = HashBytes(pixels, size);
+			if (savePath)
+				scratch.assign(pixels, pixels + size);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot->seq.load(std::memory_order_relaxed) != next) {
+				dropped++;  // overwritten while we read it
+				continue;
+			}
+			// Only a frame that survived the recheck may replace the saved one
+			if (savePath)
+				saved.swap(scratch);
+			checksum ^= hash;
+			latency_ns += NowNs() - published;
+			consumed++;
+		}
+		lastSeq = seq;
+	}
+	printf("consumed %llu frames, dropped %llu, %.3f ms average age, checksum %016llx\n",
+		(unsigned long long)consumed, (unsigned long long)dropped,
+		consumed ? latency_ns / 1e6 / consumed : 0.0, (unsigned long long)checksum);
+	if (savePath && !saved.empty() &&
+			stbi_write_png(savePath, ring.width, ring.height, 4, saved.data(), ring.stride))
+		printf("finish saving %s\n", savePath);
+	FrameRingClose(&ring);
+	return true;
+}
+
+///
+// Asynchronous file writer.
+//
+// Render threads hand finished files to the writer instead of blocking in
+// open/write/close. The io_uring backend drives the ring from one thread
+// with raw syscalls: every file goes through an openat, a write (optionally
+// linked to an fsync) and a close on the ring, each stage submitted when
+// the previous one completes, so the thread itself never blocks on the
+// filesystem. Where io_uring or those operations are unavailable a small
+// pool of threads runs open/pwrite/close instead.
+//
+// Buffers come from AsyncWriterAlloc, aligned and padded for O_DIRECT;
+// direct writes cover the padded length and the file is truncated back to
+// the real size afterwards.
+//
+typedef enum WriterBackend {
+	WRITER_URING,
+	WRITER_THREADS,
+} WriterBackend;
+
+// Called on a writer thread once the file is closed; result is the number
+// of bytes written or a negative errno.
+typedef void (*WriteCallback)(void *userdata, const char *path, int64_t result);
+
+typedef struct WriteJob {
+	std::string path;
+	uint8_t *data;
+	size_t size;
+	WriteCallback callback;
+	void *userdata;
+	int fd;
+	bool direct;     // opened with O_DIRECT, writes the padded length
+	int stage;       // WriteStage the io_uring backend is waiting on
+	int opsPending;  // io_uring operations not yet completed
+	int64_t result;
+} WriteJob;
+
+typedef enum WriteStage {
+	WRITE_STAGE_OPEN,
+	WRITE_STAGE_WRITE,
+	WRITE_STAGE_CLOSE,
+} WriteStage;
+
+typedef struct UringQueue {
+	int fd;
+	unsigned entries;
+	unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sqRing, *cqRing;
+	size_t sqRingSize, cqRingSize, sqesSize;
+} UringQueue;
+
+typedef struct AsyncWriter {
+	WriterBackend backend;
+	bool direct;
+	bool fsync;
+	size_t maxPending;
+	UringQueue uring;
+	std::vector<pthread_t> threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;      // jobs queued or writer stopping
+	pthread_cond_t idle;      // a job completed
+	std::vector<WriteJob *> pending;
+	size_t outstanding;       // submitted and not yet completed
+	uint64_t completed;
+	uint64_t failed;
+	bool running;
+} AsyncWriter;
+
+static const size_t kDirectAlign = 4096;
+
+// Closing the ring makes the kernel cancel or finish whatever was
+// submitted on it. Safe to call twice.
+static void UringDestroy(UringQueue *q)
+{
+	if (q->fd < 0)
+		return;
+	munmap(q->sqes, q->sqesSize);
+	if (q->cqRing != q->sqRing)
+		munmap(q->cqRing, q->cqRingSize);
+	munmap(q->sqRing, q->sqRingSize);
+	close(q->fd);
+	q->fd = -1;
+}
+
+static bool UringInit(UringQueue *q, unsigned entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	q->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+	if (q->fd < 0)
+		return false;
+	q->entries = params.sq_entries;
+
+	q->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	q->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		q->sqRingSize = q->cqRingSize = std::max(q->sqRingSize, q->cqRingSize);
+	q->sqRing = mmap(NULL, q->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		q->fd, IORING_OFF_SQ_RING);
+	q->cqRing = (params.features & IORING_FEAT_SINGLE_MMAP) ? q->sqRing :
+		mmap(NULL, q->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+	q->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = (struct io_uring_sqe *)mmap(NULL, q->sqesSize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (q->sqRing == MAP_FAILED || q->cqRing == MAP_FAILED || q->sqes == MAP_FAILED) {
+		int err = errno;
+		if (q->sqes != MAP_FAILED)
+			munmap(q->sqes, q->sqesSize);
+		if (q->cqRing != MAP_FAILED && q->cqRing != q->sqRing)
+			munmap(q->cqRing, q->cqRingSize);
+		if (q->sqRing != MAP_FAILED)
+			munmap(q->sqRing, q->sqRingSize);
+		close(q->fd);
+		errno = err;
+		return false;
+	}
+
+	// openat and close on the ring need Linux 5.6
+	const int probeOps = IORING_OP_CLOSE + 1;
+	std::vector<uint8_t> probeData(sizeof(struct io_uring_probe) + probeOps * sizeof(struct io_uring_probe_op));
+	struct io_uring_probe *probe = (struct io_uring_probe *)probeData.data();
+	if (syscall(__NR_io_uring_register, q->fd, IORING_REGISTER_PROBE, probe, probeOps) < 0 ||
+			probe->last_op < IORING_OP_CLOSE ||
+			!(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+			!(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)) {
+		UringDestroy(q);
+		errno = EOPNOTSUPP;
+		return false;
+	}
+
+	uint8_t *sq = (uint8_t *)q->sqRing, *cq = (uint8_t *)q->cqRing;
+	q->sqHead = (unsigned *)(sq + params.sq_off.head);
+	q->sqTail = (unsigned *)(sq + params.sq_off.tail);
+	q->sqMask = (unsigned *)(sq + params.sq_off.ring_mask);
+	q->sqArray = (unsigned *)(sq + params.sq_off.array);
+	q->cqHead = (unsigned *)(cq + params.cq_off.head);
+	q->cqTail = (unsigned *)(cq + params.cq_off.tail);
+	q->cqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+	return true;
+}
+
+// Only the writer thread touches the submission queue, so the tail needs
+// no atomics beyond publishing it to the kernel.
+static struct io_uring_sqe *UringGetSqe(UringQueue *q)
+{
+	unsigned tail = *q->sqTail;
+	unsigned head = __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE);
+	if (tail - head >= q->entries)
+		return nullptr;
+	unsigned index = tail & *q->sqMask;
+	struct io_uring_sqe *sqe = &q->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	q->sqArray[index] = index;
+	__atomic_store_n(q->sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Submit every queued entry the kernel has not consumed yet.
+static int UringEnter(UringQueue *q, unsigned waitFor)
+{
+	int ret;
+	do {
+		unsigned submit = *q->sqTail - __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE);
+		ret = (int)syscall(__NR_io_uring_enter, q->fd, submit, waitFor,
+			waitFor ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+uint8_t *AsyncWriterAlloc(size_t size)
+{
+	void *p = nullptr;
+	size_t padded = (size + kDirectAlign - 1) / kDirectAlign * kDirectAlign;
+	if (posix_memalign(&p, kDirectAlign, padded ? padded : kDirectAlign) != 0)
+		return nullptr;
+	return (uint8_t *)p;
+}
+
+static const int kWriteOpenFlags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+static int64_t WriteJobOpen(AsyncWriter *writer, WriteJob *job)
+{
+	const int flags = kWriteOpenFlags;
+	job->direct = false;
+	job->fd = -1;
+	if (writer->direct) {
+		job->fd = open(job->path.c_str(), flags | O_DIRECT, 0644);
+		// Filesystems such as tmpfs refuse O_DIRECT; write buffered there
+		job->direct = job->fd >= 0;
+	}
+	if (job->fd < 0)
+		job->fd = open(job->path.c_str(), flags, 0644);
+	return job->fd < 0 ? -errno : 0;
+}
+
+static size_t WriteJobLength(const WriteJob *job)
+{
+	return job->direct ? (job->size + kDirectAlign - 1) / kDirectAlign * kDirectAlign : job->size;
+}
+
+// Cut the padding of a direct write back off the file.
+static void WriteJobTruncate(WriteJob *job)
+{
+	if (job->result >= 0 && job->direct && WriteJobLength(job) != job->size &&
+			ftruncate(job->fd, job->size) != 0)
+		job->result = -errno;
+}
+
+// Report the job, which has no open file left, and free it.
+static void WriteJobFinish(AsyncWriter *writer, WriteJob *job)
+{
+	if (job->result >= 0)
+		job->result = job->size;
+	if (job->callback)
+		job->callback(job->userdata, job->path.c_str(), job->result);
+	if (job->result >= 0)
+		MetricAdd(&gMetrics.filesWritten);
+
+	free(job->data);
+	pthread_mutex_lock(&writer->lock);
+	writer->outstanding--;
+	if (job->result < 0)
+		writer->failed++;
+	else
+		writer->completed++;
+	pthread_cond_broadcast(&writer->idle);
+	pthread_mutex_unlock(&writer->lock);
+	delete job;
+}
+
+static void UringQueueOpen(AsyncWriter *writer, WriteJob *job, bool direct)
+{
+	struct io_uring_sqe *sqe = UringGetSqe(&writer->uring);
+	sqe->opcode = IORING_OP_OPENAT;
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)job->path.c_str();
+	sqe->len = 0644;
+	sqe->open_flags = kWriteOpenFlags | (direct ? O_DIRECT : 0);
+	sqe->user_data = (uint64_t)(uintptr_t)job;
+	job->direct = direct;
+	job->stage = WRITE_STAGE_OPEN;
+	job->opsPending = 1;
+}
+
+static void UringQueueWrite(AsyncWriter *writer, WriteJob *job)
+{
+	struct io_uring_sqe *sqe = UringGetSqe(&writer->uring);
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = job->fd;
+	sqe->addr = (uint64_t)(uintptr_t)job->data;
+	sqe->len = (uint32_t)WriteJobLength(job);
+	sqe->off = 0;
+	sqe->user_data = (uint64_t)(uintptr_t)job;
+	job->stage = WRITE_STAGE_WRITE;
+	job->opsPending = 1;
+	if (writer->fsync) {
+		sqe->flags |= IOSQE_IO_LINK;
+		sqe = UringGetSqe(&writer->uring);
+		sqe->opcode = IORING_OP_FSYNC;
+		sqe->fd = job->fd;
+		sqe->user_data = (uint64_t)(uintptr_t)job;
+		job->opsPending = 2;
+	}
+}
+
+static void UringQueueClose(AsyncWriter *writer, WriteJob *job)
+{
+	// No ftruncate on the ring before Linux 6.9; it only runs for direct
+	// writes whose size is not a multiple of the block size
+	WriteJobTruncate(job);
+	struct io_uring_sqe *sqe = UringGetSqe(&writer->uring);
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd = job->fd;
+	sqe->user_data = (uint64_t)(uintptr_t)job;
+	job->stage = WRITE_STAGE_CLOSE;
+	job->opsPending = 1;
+}
+
+static void *uring_writer_func(void *userdata)
+{
+	AsyncWriter *writer = static_cast<AsyncWriter *>(userdata);
+	UringQueue *q = &writer->uring;
+	// Every stage of a job has at most two entries queued (write and fsync)
+	const size_t maxInflight = q->entries / 2;
+	std::vector<WriteJob *> inflight;
+	std::vector<WriteJob *> batch;
+	int fatal = 0;  // negative errno once the ring is unusable
+	TraceSetThreadName("uring writer");
+	PinThread(&gPinCPU, "uring writer");
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->running || !writer->pending.empty() || !inflight.empty()) {
+		while (writer->running && writer->pending.empty() && inflight.empty())
+			pthread_cond_wait(&writer->cond, &writer->lock);
+		size_t take = std::min(maxInflight - inflight.size(), writer->pending.size());
+		batch.assign(writer->pending.begin(), writer->pending.begin() + take);
+		writer->pending.erase(writer->pending.begin(), writer->pending.begin() + take);
+		pthread_mutex_unlock(&writer->lock);
+
+		for (WriteJob *job : batch) {
+			if (fatal) {
+				job->result = fatal;
+				WriteJobFinish(writer, job);
+				continue;
+			}
+			UringQueueOpen(writer, job, writer->direct);
+			inflight.push_back(job);
+		}
+		if (inflight.empty()) {
+			pthread_mutex_lock(&writer->lock);
+			continue;
+		}
+
+		// Submit the new stages and block for at least one completion.
+		// EAGAIN and EBUSY mean the kernel is short of memory or of room
+		// for completions: reap what is there and try again.
+		int entered = UringEnter(q, 1);
+		if (entered < 0 && errno != EAGAIN && errno != EBUSY) {
+			// Nothing queued will complete. Tear the ring down first so the
+			// kernel is done with the buffers and paths, then fail the jobs.
+			fatal = -errno;
+			printf("io_uring_enter: %s, failing %zu writes\n", strerror(errno), inflight.size());
+			UringDestroy(q);
+			for (WriteJob *job : inflight) {
+				if (job->fd >= 0 && job->stage != WRITE_STAGE_CLOSE)
+					close(job->fd);
+				job->result = fatal;
+				WriteJobFinish(writer, job);
+			}
+			inflight.clear();
+			pthread_mutex_lock(&writer->lock);
+			continue;
+		}
+
+		unsigned head = *q->cqHead;
+		unsigned tail = __atomic_load_n(q->cqTail, __ATOMIC_ACQUIRE);
+		if (entered < 0 && head == tail)
+			usleep(100);
+		for (; head != tail; head++) {
+			const struct io_uring_cqe *cqe = &q->cqes[head & *q->cqMask];
+			WriteJob *job = (WriteJob *)(uintptr_t)cqe->user_data;
+			const int res = cqe->res;
+			const bool last = --job->opsPending == 0;
+			switch (job->stage) {
+			case WRITE_STAGE_OPEN:
+				if (res >= 0) {
+					job->fd = res;
+					UringQueueWrite(writer, job);
+				} else if (job->direct) {
+					// Filesystems such as tmpfs refuse O_DIRECT; write buffered there
+					UringQueueOpen(writer, job, false);
+				} else {
+					job->result = res;
+					inflight.erase(std::find(inflight.begin(), inflight.end(), job));
+					WriteJobFinish(writer, job);
+				}
+				break;
+			case WRITE_STAGE_WRITE:
+				if (res < 0 && job->result >= 0)
+					job->result = res;
+				else if (res >= 0 && job->opsPending == (writer->fsync ? 1 : 0) &&
+						(size_t)res != WriteJobLength(job))
+					job->result = -EIO;  // short write
+				if (last)
+					UringQueueClose(writer, job);
+				break;
+			case WRITE_STAGE_CLOSE:
+				if (res < 0 && job->result >= 0)
+					job->result = res;
+				job->fd = -1;
+				inflight.erase(std::find(inflight.begin(), inflight.end(), job));
+				WriteJobFinish(writer, job);
+				break;
+			}
+		}
+		__atomic_store_n(q->cqHead, head, __ATOMIC_RELEASE);
+
+		pthread_mutex_lock(&writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return 0;
+}
+
+static void *pwrite_writer_func(void *userdata)
+{
+	AsyncWriter *writer = static_cast<AsyncWriter *>(userdata);
+	TraceSetThreadName("pwrite writer");
+	PinThread(&gPinCPU, "pwrite writer");
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->running || !writer->pending.empty()) {
+		if (writer->pending.empty()) {
+			pthread_cond_wait(&writer->cond, &writer->lock);
+			continue;
+		}
+		WriteJob *job = writer->pending.front();
+		writer->pending.erase(writer->pending.begin());
+		pthread_mutex_unlock(&writer->lock);
+
+		job->result = WriteJobOpen(writer, job);
+		const size_t length = WriteJobLength(job);
+		for (size_t done = 0; job->result >= 0 && done < length; ) {
+			ssize_t n = pwrite(job->fd, job->data + done, length - done, done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				job->result = n < 0 ? -errno : -EIO;
+			else
+				done += n;
+		}
+		if (job->result >= 0 && writer->fsync && fsync(job->fd) != 0)
+			job->result = -errno;
+		if (job->fd >= 0) {
+			WriteJobTruncate(job);
+			if (close(job->fd) != 0 && job->result >= 0)
+				job->result = -errno;
+		}
+		WriteJobFinish(writer, job);
+
+		pthread_mutex_lock(&writer->lock);
+	}
+	pthread_mutex_unlock(&writer->lock);
+	return 0;
+}
+
+///
+// Start a writer. WRITER_URING falls back to WRITER_THREADS if the kernel
+// does not allow io_uring. At most maxPending files are queued or in
+// flight; AsyncWriterSubmit blocks beyond that.
+//
+void AsyncWriterStart(AsyncWriter *writer, WriterBackend backend, int threads, bool direct,
+	bool fsync, size_t maxPending)
+{
+	writer->direct = direct;
+	writer->fsync = fsync;
+	writer->maxPending = maxPending;
+	writer->outstanding = 0;
+	writer->completed = 0;
+	writer->failed = 0;
+	writer->running = true;
+	pthread_mutex_init(&writer->lock, NULL);
+	pthread_cond_init(&writer->cond, NULL);
+	pthread_cond_init(&writer->idle, NULL);
+
+	if (backend == WRITER_URING && !UringInit(&writer->uring, 256)) {
+		printf("io_uring unavailable (%s), writing from a thread pool\n", strerror(errno));
+		backend = WRITER_THREADS;
+	}
+	writer->backend = backend;
+	writer->threads.resize(backend == WRITER_URING ? 1 : threads);
+	for (pthread_t &thread : writer->threads)
+		pthread_create(&thread, NULL, backend == WRITER_URING ? uring_writer_func : pwrite_writer_func, writer);
+}
+
+///
+// Queue `size` bytes at data, from AsyncWriterAlloc, to be written to path.
+// The writer owns and frees the buffer.
+//
+void AsyncWriterSubmit(AsyncWriter *writer, const char *path, uint8_t *data, size_t size,
+	WriteCallback callback, void *userdata)
+{
+	WriteJob *job = new WriteJob;
+	job->path = path;
+	job->data = data;
+	job->size = size;
+	job->callback = callback;
+	job->userdata = userdata;
+	job->fd = -1;
+	job->direct = false;
+	job->stage = WRITE_STAGE_OPEN;
+	job->opsPending = 0;
+	job->result = 0;
+
+	pthread_mutex_lock(&writer->lock);
+	while (writer->outstanding >= writer->maxPending)
+		pthread_cond_wait(&writer->idle, &writer->lock);
+	writer->outstanding++;
+	writer->pending.push_back(job);
+	pthread_cond_signal(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+///
+// Block until every submitted file has completed.
+//
+void AsyncWriterFlush(AsyncWriter *writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	while (writer->outstanding)
+		pthread_cond_wait(&writer->idle, &writer->lock);
+	pthread_mutex_unlock(&writer->lock);
+}
+
+void AsyncWriterStop(AsyncWriter *writer)
+{
+	pthread_mutex_lock(&writer->lock);
+	writer->running = false;
+	pthread_cond_broadcast(&writer->cond);
+	pthread_mutex_unlock(&writer->lock);
+	for (pthread_t thread : writer->threads)
+		pthread_join(thread, NULL);
+	if (writer->backend == WRITER_URING)
+		UringDestroy(&writer->uring);
+	pthread_mutex_destroy(&writer->lock);
+	pthread_cond_destroy(&writer->cond);
+	pthread_cond_destroy(&writer->idle);
+}
+
+///
+// Image archive.
+//
+// Packs many encoded images into one file instead of one file each:
+//
+//   ArchiveHeader | image 0 | image 1 | ... | ArchiveIndexEntry[count] | ArchiveTrailer
+//
+// Images are appended sequentially as they arrive; the index, sorted by
+// job id, and the fixed-size trailer are written on close. Readers map the
+// file, find the trailer at the end and look images up in place. All
+// fields are little-endian.
+//
+static const char kArchiveMagic[8] = { 'I', 'M', 'G', 'A', 'R', 'C', 'H', '1' };
+static const char kArchiveIndexMagic[8] = { 'I', 'M', 'G', 'A', 'I', 'D', 'X', '1' };
+
+typedef struct ArchiveHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} ArchiveHeader;
+
+typedef struct ArchiveIndexEntry {
+	uint64_t jobId;
+	uint64_t offset;  // from the start of the file
+	uint64_t length;
+	uint64_t hash;    // HashBytes of the image bytes
+} ArchiveIndexEntry;
+
+typedef struct ArchiveTrailer {
+	uint64_t indexOffset;
+	uint64_t count;
+	uint64_t indexHash;  // HashBytes of the index entries
+	char magic[8];
+} ArchiveTrailer;
+
+typedef struct ArchiveWriter {
+	FILE *file;
+	uint64_t offset;
+	std::vector<ArchiveIndexEntry> index;
+	bool failed;  // a write failed; offsets past it are unknown
+	pthread_mutex_t lock;
+} ArchiveWriter;
+
+typedef struct ArchiveReader {
+	const uint8_t *base;
+	size_t size;
+	const ArchiveIndexEntry *entries;
+	uint64_t count;
+} ArchiveReader;
+
+static const size_t kArchiveBufferSize = 1 << 20;
+
+bool ArchiveOpen(ArchiveWriter *archive, const char *path)
+{
+	archive->file = fopen(path, "wb");
+	if (!archive->file) {
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	// Large sequential writes instead of one per image
+	setvbuf(archive->file, NULL, _IOFBF, kArchiveBufferSize);
+
+	ArchiveHeader header;
+	memcpy(header.magic, kArchiveMagic, sizeof(header.magic));
+	header.version = 1;
+	header.reserved = 0;
+	archive->failed = fwrite(&header, sizeof(header), 1, archive->file) != 1;
+	archive->offset = sizeof(header);
+	archive->index.clear();
+	pthread_mutex_init(&archive->lock, NULL);
+	return true;
+}
+
+///
+// Append one encoded image. Safe to call from several threads; images are
+// stored in the order the calls complete. After a failed write the file
+// position no longer matches the offsets, so the archive stops accepting
+// images and ArchiveClose fails.
+//
+bool ArchiveAppend(ArchiveWriter *archive, uint64_t jobId, const void *data, size_t length)
+{
+	ArchiveIndexEntry entry = { jobId, 0, length, HashBytes(data, length) };
+
+	pthread_mutex_lock(&archive->lock);
+	bool ok = !archive->failed;
+	if (ok) {
+		entry.offset = archive->offset;
+		ok = fwrite(data, 1, length, archive->file) == length;
+		if (ok) {
+			archive->offset += length;
+			archive->index.push_back(entry);
+		} else {
+			printf("archive write failed: %s\n", strerror(errno));
+			archive->failed = true;
+		}
+	}
+	pthread_mutex_unlock(&archive->lock);
+	return ok;
+}
+
+///
+// Write the index and trailer and close the file. An archive whose writes
+// failed gets no trailer, so readers reject it.
+//
+bool ArchiveClose(ArchiveWriter *archive)
+{
+	if (archive->failed) {
+		fclose(archive->file);
+		pthread_mutex_destroy(&archive->lock);
+		return false;
+	}
+
+	std::sort(archive->index.begin(), archive->index.end(),
+		[](const ArchiveIndexEntry &a, const ArchiveIndexEntry &b) { return a.jobId < b.jobId; });
+
+	const size_t indexSize = archive->index.size() * sizeof(ArchiveIndexEntry);
+	ArchiveTrailer trailer;
+	trailer.indexOffset = archive->offset;
+	trailer.count = archive->index.size();
+	trailer.indexHash = HashBytes(archive->index.data(), indexSize);
+	memcpy(trailer.magic, kArchiveIndexMagic, sizeof(trailer.magic));
+
+	bool ok = fwrite(archive->index.data(), 1, indexSize, archive->file) == indexSize &&
+		fwrite(&trailer, sizeof(trailer), 1, archive->file) == 1;
+	ok = fclose(archive->file) == 0 && ok;
+	pthread_mutex_destroy(&archive->lock);
+	return ok;
+}
+
+bool ArchiveMap(ArchiveReader *reader, const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		printf("cannot open %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+	reader->size = st.st_size;
+	void *p = reader->size ? mmap(NULL, reader->size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (p == MAP_FAILED) {
+		printf("cannot map %s\n", path);
+		return false;
+	}
+	reader->base = (const uint8_t *)p;
+
+	ArchiveTrailer trailer;
+	bool valid = reader->size >= sizeof(ArchiveHeader) + sizeof(trailer) &&
+		!memcmp(reader->base, kArchiveMagic, sizeof(kArchiveMagic));
+	if (valid) {
+		memcpy(&trailer, reader->base + reader->size - sizeof(trailer), sizeof(trailer));
+		valid = !memcmp(trailer.magic, kArchiveIndexMagic, sizeof(trailer.magic)) &&
+			trailer.indexOffset <= reader->size - sizeof(trailer) &&
+			trailer.count <= (reader->size - sizeof(trailer) - trailer.indexOffset) / sizeof(ArchiveIndexEntry);
+	}
+	if (valid) {
+		reader->entries = (const ArchiveIndexEntry *)(reader->base + trailer.indexOffset);
+		reader->count = trailer.count;
+		valid = HashBytes(reader->entries, reader->count * sizeof(ArchiveIndexEntry)) == trailer.indexHash;
+	}
+	if (!valid) {
+		printf("%s is not a complete image archive\n", path);
+		munmap((void *)reader->base, reader->size);
+		return false;
+	}
+	return true;
+}
+
+///
+// Look an image up by job id; returns nullptr if it is not in the archive.
+//
+const ArchiveIndexEntry *ArchiveFind(const ArchiveReader *reader, uint64_t jobId)
+{
+	const ArchiveIndexEntry *end = reader->entries + reader->count;
+	const ArchiveIndexEntry *entry = std::lower_bound(reader->entries, end, jobId,
+		[](const ArchiveIndexEntry &e, uint64_t id) { return e.jobId < id; });
+	return entry != end && entry->jobId == jobId ? entry : nullptr;
+}
+
+void ArchiveUnmap(ArchiveReader *reader)
+{
+	munmap((void *)reader->base, reader->size);
+}
+
+///
+// Check every image of an archive against its hash and print a summary.
+//
+bool ArchiveVerify(const char *path)
+{
+	ArchiveReader reader;
+	if (!ArchiveMap(&reader, path))
+		return false;
+	// Images lie between the header and the index
+	const uint64_t indexOffset = (const uint8_t *)reader.entries - reader.base;
+	uint64_t bad = 0, bytes = 0;
+	for (uint64_t i = 0; i < reader.count; i++) {
+		const ArchiveIndexEntry &e = reader.entries[i];
+		if (e.offset < sizeof(ArchiveHeader) || e.offset > indexOffset ||
+				e.length > indexOffset - e.offset ||
+				HashBytes(reader.base + e.offset, e.length) != e.hash)
+			bad++;
+		bytes += e.length;
+	}
+	printf("%s: %llu images, %llu bytes, %llu corrupt", path, (unsigned long long)reader.count,
+		(unsigned long long)bytes, (unsigned long long)bad);
+	if (reader.count)
+		printf(", job ids %llu..%llu", (unsigned long long)reader.entries[0].jobId,
+			(unsigned long long)reader.entries[reader.count - 1].jobId);
+	printf("\n");
+	ArchiveUnmap(&reader);
+	return bad == 0;
+}
+
+///
+// Work-stealing task scheduler.
+//
+// Every CPU worker and every context-owning GL thread has its own deque of
+// CPU tasks (conversion, filtering, deflate, I/O). A thread pushes and pops
+// its own deque at the back and idle threads steal from the front of the
+// others, so work spawned by a busy thread spreads to idle cores. GL tasks
+// need a context current and go to a per-GL-thread affine queue that only
+// its owner runs; GL threads steal CPU tasks while they have nothing else.
+//
+typedef void (*TaskFunc)(void *arg);
+
+typedef struct TaskGroup {
+	std::atomic<int> pending;
+} TaskGroup;
+
+typedef struct Task {
+	TaskFunc func;
+	void *arg;
+	TaskGroup *group;
+} Task;
+
+typedef struct TaskDeque {
+	pthread_mutex_t lock;
+	std::deque<Task> tasks;
+	std::atomic<int> size;
+} TaskDeque;
+
+typedef struct Scheduler {
+	std::vector<TaskDeque *> deques;  // CPU workers first, then GL threads
+	std::vector<TaskDeque *> affine;  // one per GL thread
+	std::vector<pthread_t> threads;
+	int cpuWorkers;
+	std::atomic<int> stealable;  // CPU tasks queued across all deques
+	std::atomic<int> sleepers;
+	std::atomic<int> nextWorker;
+	std::atomic<unsigned> nextDeque;  // round robin for submits from other threads
+	std::atomic<uint64_t> steals;
+	std::atomic<bool> running;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+} Scheduler;
+
+static thread_local Scheduler *tScheduler = nullptr;
+static thread_local int tWorkerIndex = -1;  // own deque
+static thread_local int tGLIndex = -1;      // own affine queue
+
+static void TaskDequePush(TaskDeque *deque, const Task &task)
+{
+	pthread_mutex_lock(&deque->lock);
+	deque->tasks.push_back(task);
+	deque->size.fetch_add(1);
+	pthread_mutex_unlock(&deque->lock);
+}
+
+static bool TaskDequePop(TaskDeque *deque, Task *task, bool front)
+{
+	if (deque->size.load(std::memory_order_relaxed) == 0)
+		return false;
+	pthread_mutex_lock(&deque->lock);
+	bool found = !deque->tasks.empty();
+	if (found) {
+		*task = front ? deque->tasks.front() : deque->tasks.back();
+		if (front)
+			deque->tasks.pop_front();
+		else
+			deque->tasks.pop_back();
+		deque->size.fetch_sub(1);
+	}
+	pthread_mutex_unlock(&deque->lock);
+	return found;
+}
+
+///
+// Wake sleeping threads. The counters are sequentially consistent, so
+// either a sleeper sees the new work or the waker sees the sleeper.
+//
+static void SchedulerNotify(Scheduler *sched)
+{
+	if (sched->sleepers.load() == 0)
+		return;
+	pthread_mutex_lock(&sched->lock);
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+}
+
+static bool SchedulerPopCPU(Scheduler *sched, Task *task)
+{
+	if (sched->stealable.load() == 0)
+		return false;
+	int own = tScheduler == sched ? tWorkerIndex : -1;
+	if (own >= 0 && TaskDequePop(sched->deques[own], task, false)) {
+		sched->stealable.fetch_sub(1);
+		return true;
+	}
+	// Steal the oldest task of another thread, starting after our own deque
+	const int count = (int)sched->deques.size();
+	for (int i = 1; i <= count; i++) {
+		int victim = (own + i) % count;
+		if (victim != own && TaskDequePop(sched->deques[victim], task, true)) {
+			sched->stealable.fetch_sub(1);
+			if (own >= 0)
+				sched->steals.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+static void SchedulerRunTask(Scheduler *sched, const Task &task)
+{
+	task.func(task.arg);
+	if (task.group) {
+		task.group->pending.fetch_sub(1);
+		SchedulerNotify(sched);
+	}
+}
+
+///
+// Queue a CPU task. From a scheduler thread it goes to that thread's own
+// deque, from anywhere else round robin across the CPU workers.
+//
+void SchedulerSubmit(Scheduler *sched, TaskFunc func, void *arg, TaskGroup *group)
+{
+	if (group)
+		group->pending.fetch_add(1);
+	int index = tScheduler == sched ? tWorkerIndex : -1;
+	if (index < 0) {
+		int workers = sched->cpuWorkers > 0 ? sched->cpuWorkers : (int)sched->deques.size();
+		index = sched->nextDeque.fetch_add(1, std::memory_order_relaxed) % workers;
+	}
+	TaskDequePush(sched->deques[index], { func, arg, group });
+	sched->stealable.fetch_add(1);
+	SchedulerNotify(sched);
+}
+
+///
+// Queue a task that must run on GL thread glIndex, with its context current.
+//
+void SchedulerSubmitGL(Scheduler *sched, int glIndex, TaskFunc func, void *arg, TaskGroup *group)
+{
+	if (group)
+		group->pending.fetch_add(1);
+	TaskDequePush(sched->affine[glIndex], { func, arg, group });
+	SchedulerNotify(sched);
+}
+
+///
+// Run CPU tasks on the calling thread until at most limit tasks of group
+// are pending. Never runs GL tasks, so it is safe to call from inside one.
+//
+void TaskGroupWait(Scheduler *sched, TaskGroup *group, int limit = 0)
+{
+	Task task;
+	while (group->pending.load() > limit) {
+		if (SchedulerPopCPU(sched, &task)) {
+			SchedulerRunTask(sched, task);
+			continue;
+		}
+		pthread_mutex_lock(&sched->lock);
+		sched->sleepers.fetch_add(1);
+		while (group->pending.load() > limit && sched->stealable.load() == 0)
+			pthread_cond_wait(&sched->wake, &sched->lock);
+		sched->sleepers.fetch_sub(1);
+		pthread_mutex_unlock(&sched->lock);
+	}
+}
+
+static void *scheduler_worker_func(void *userdata)
+{
+	Scheduler *sched = static_cast<Scheduler *>(userdata);
+	tScheduler = sched;
+	tWorkerIndex = sched->nextWorker.fetch_add(1);
+	char name[32];
+	snprintf(name, sizeof(name), "cpu worker %d", tWorkerIndex);
+	TraceSetThreadName(name);
+	PinThread(&gPinCPU, name);
+
+	Task task;
+	while (sched->running.load()) {
+		if (SchedulerPopCPU(sched, &task)) {
+			SchedulerRunTask(sched, task);
+			continue;
+		}
+		pthread_mutex_lock(&sched->lock);
+		sched->sleepers.fetch_add(1);
+		while (sched->running.load() && sched->stealable.load() == 0)
+			pthread_cond_wait(&sched->wake, &sched->lock);
+		sched->sleepers.fetch_sub(1);
+		pthread_mutex_unlock(&sched->lock);
+	}
+	return NULL;
+}
+
+///
+// Start cpuWorkers CPU threads and make room for glThreads GL threads,
+// which the caller creates and which call SchedulerRunGL.
+//
+void SchedulerStart(Scheduler *sched, int cpuWorkers, int glThreads)
+{
+	sched->cpuWorkers = cpuWorkers;
+	for (int i = 0; i < cpuWorkers + glThreads; i++) {
+		TaskDeque *deque = new TaskDeque();
+		pthread_mutex_init(&deque->lock, NULL);
+		sched->deques.push_back(deque);
+	}
+	for (int i = 0; i < glThreads; i++) {
+		TaskDeque *deque = new TaskDeque();
+		pthread_mutex_init(&deque->lock, NULL);
+		sched->affine.push_back(deque);
+	}
+	sched->stealable.store(0);
+	sched->sleepers.store(0);
+	sched->nextWorker.store(0);
+	sched->nextDeque.store(0);
+	sched->steals.store(0);
+	sched->running.store(true);
+	pthread_mutex_init(&sched->lock, NULL);
+	pthread_cond_init(&sched->wake, NULL);
+	sched->threads.resize(cpuWorkers);
+	for (int i = 0; i < cpuWorkers; i++)
+		pthread_create(&sched->threads[i], NULL, scheduler_worker_func, sched);
+}
+
+///
+// Serve GL thread glIndex from the calling thread, which owns its context:
+// run its GL tasks first and steal CPU tasks in between, until the
+// scheduler stops.
+//
+void SchedulerRunGL(Scheduler *sched, int glIndex)
+{
+	tScheduler = sched;
+	tGLIndex = glIndex;
+	tWorkerIndex = sched->cpuWorkers + glIndex;
+	TaskDeque *affine = sched->affine[glIndex];
+
+	Task task;
+	while (sched->running.load()) {
+		if (TaskDequePop(affine, &task, true) || SchedulerPopCPU(sched, &task)) {
+			SchedulerRunTask(sched, task);
+			continue;
+		}
+		pthread_mutex_lock(&sched->lock);
+		sched->sleepers.fetch_add(1);
+		while (sched->running.load() && sched->stealable.load() == 0 && affine->size.load() == 0)
+			pthread_cond_wait(&sched->wake, &sched->lock);
+		sched->sleepers.fetch_sub(1);
+		pthread_mutex_unlock(&sched->lock);
+	}
+	tScheduler = nullptr;
+	tGLIndex = -1;
+	tWorkerIndex = -1;
+}
+
+///
+// Stop all threads once the caller has waited for its work. Joins the CPU
+// workers; GL threads return from SchedulerRunGL and are joined by their
+// creator.
+//
+void SchedulerStop(Scheduler *sched)
+{
+	pthread_mutex_lock(&sched->lock);
+	sched->running.store(false);
+	pthread_cond_broadcast(&sched->wake);
+	pthread_mutex_unlock(&sched->lock);
+	for (pthread_t thread : sched->threads)
+		pthread_join(thread, NULL);
+}
+
+void SchedulerDestroy(Scheduler *sched)
+{
+	for (TaskDeque *deque : sched->deques) {
+		pthread_mutex_destroy(&deque->lock);
+		delete deque;
+	}
+	for (TaskDeque *deque : sched->affine) {
+		pthread_mutex_destroy(&deque->lock);
+		delete deque;
+	}
+	sched->deques.clear();
+	sched->affine.clear();
+	sched->threads.clear();
+	pthread_mutex_destroy(&sched->lock);
+	pthread_cond_destroy(&sched->wake);
+}
+
+///
+// Dirty rectangle tracking.
+//
+// Each frame the renderer reports its draws with a stable id, their pixel
+// bounds and a key summarising everything that affects their output. Draws
+// that appear, disappear, move or change key damage both their old and new
+// bounds; everything else is assumed identical to the previous frame, so only
+// the damaged rectangles need to be rendered, read back and re-encoded.
+//
+typedef struct Rect {
+	GLint x;
+	GLint y;
+	GLsizei width;
+	GLsizei height;
+} Rect;
+
+typedef struct DamageEntry {
+	int id;
+	Rect bounds;
+	uint64_t key;
+} DamageEntry;
+
+typedef struct DirtyTracker {
+	GLsizei width;
+	GLsizei height;
+	bool full;
+	std::vector<DamageEntry> previous;
+	std::vector<DamageEntry> current;
+	std::vector<Rect> dirty;
+} DirtyTracker;
+
+// Beyond this many separate rectangles a frame is damaged as one bounding box.
+static const size_t kMaxDirtyRects = 8;
+
+static bool RectEmpty(const Rect &r)
+{
+	return r.width <= 0 || r.height <= 0;
+}
+
+static Rect RectUnion(const Rect &a, const Rect &b)
+{
+	if (RectEmpty(a))
+		return b;
+	if (RectEmpty(b))
+		return a;
+	GLint x0 = a.x < b.x ? a.x : b.x;
+	GLint y0 = a.y < b.y ? a.y : b.y;
+	GLint x1 = (a.x + a.width > b.x + b.width) ? a.x + a.width : b.x + b.width;
+	GLint y1 = (a.y + a.height > b.y + b.height) ? a.y + a.height : b.y + b.height;
+	Rect r = { x0, y0, x1 - x0, y1 - y0 };
+	return r;
+}
+
+static bool RectTouches(const Rect &a, const Rect &b)
+{
+	return a.x <= b.x + b.width && b.x <= a.x + a.width &&
+		a.y <= b.y + b.height && b.y <= a.y + a.height;
+}
+
+static Rect RectClip(const Rect &r, GLsizei width, GLsizei height)
+{
+	GLint x0 = r.x < 0 ? 0 : r.x;
+	GLint y0 = r.y < 0 ? 0 : r.y;
+	GLint x1 = r.x + r.width > width ? width : r.x + r.width;
+	GLint y1 = r.y + r.height > height ? height : r.y + r.height;
+	Rect c = { x0, y0, x1 - x0, y1 - y0 };
+	return c;
+}
+
+///
+// Window-space bounds of count vertices given in normalized device
+// coordinates (x, y first in each vertex), padded by a pixel to cover
+// rasterization rounding.
+//
+Rect NDCBounds(const GLfloat *vertices, int count, int strideFloats, GLsizei width, GLsizei height)
+{
+	GLfloat minX = 1.0f, minY = 1.0f, maxX = -1.0f, maxY = -1.0f;
+	for (int i = 0; i < count; i++) {
+		const GLfloat *v = vertices + i * strideFloats;
+		minX = v[0] < minX ? v[0] : minX;
+		maxX = v[0] > maxX ? v[0] : maxX;
+		minY = v[1] < minY ? v[1] : minY;
+		maxY = v[1] > maxY ? v[1] : maxY;
+	}
+	GLint x0 = (GLint)((minX * 0.5f + 0.5f) * width) - 1;
+	GLint y0 = (GLint)((minY * 0.5f + 0.5f) * height) - 1;
+	GLint x1 = (GLint)((maxX * 0.5f + 0.5f) * width) + 2;
+	GLint y1 = (GLint)((maxY * 0.5f + 0.5f) * height) + 2;
+	Rect r = { x0, y0, x1 - x0, y1 - y0 };
+	return RectClip(r, width, height);
+}
+
+void DirtyTrackerInit(DirtyTracker *tracker, GLsizei width, GLsizei height)
+{
+	tracker->width = width;
+	tracker->height = height;
+	tracker->full = true;
+	tracker->previous.clear();
+	tracker->current.clear();
+	tracker->dirty.clear();
+}
+
+///
+// Damage the whole frame, e.g. after the persistent CPU image was lost.
+//
+void DirtyTrackerInvalidate(DirtyTracker *tracker)
+{
+	tracker->full = true;
+}
+
+void DirtyTrackerAddDraw(DirtyTracker *tracker, int id, const Rect &bounds, uint64_t key)
+{
+	DamageEntry entry = { id, bounds, key };
+	tracker->current.push_back(entry);
+}
+
+static void AddDirty(std::vector<Rect> &dirty, Rect r)
+{
+	if (RectEmpty(r))
+		return;
+	// Fold every rectangle r touches into it, repeating as it grows
+	for (size_t i = 0; i < dirty.size(); ) {
+		if (RectTouches(dirty[i], r)) {
+			r = RectUnion(r, dirty[i]);
+			dirty.erase(dirty.begin() + i);
+			i = 0;
+		} else {
+			i++;
+		}
+	}
+	dirty.push_back(r);
+}
+
+///
+// Finish the frame's draw list and return the rectangles that differ from
+// the previous frame, clipped to the frame and non-overlapping.
+//
+const std::vector<Rect> &DirtyTrackerEndFrame(DirtyTracker *tracker)
+{
+	std::vector<Rect> &dirty = tracker->dirty;
+	dirty.clear();
+
+	if (tracker->full) {
+		Rect all = { 0, 0, tracker->width, tracker->height };
+		dirty.push_back(all);
+		tracker->full = false;
+	} else {
+		for (size_t i = 0; i < tracker->current.size(); i++) {
+			const DamageEntry &cur = tracker->current[i];
+			const DamageEntry *prev = nullptr;
+			for (size_t j = 0; j < tracker->previous.size() && !prev; j++)
+				if (tracker->previous[j].id == cur.id)
+					prev = &tracker->previous[j];
+			if (!prev) {
+				AddDirty(dirty, cur.bounds);
+			} else if (prev->key != cur.key || memcmp(&prev->bounds, &cur.bounds, sizeof(Rect))) {
+				AddDirty(dirty, prev->bounds);
+				AddDirty(dirty, cur.bounds);
+			}
+		}
+		for (size_t j = 0; j < tracker->previous.size(); j++) {
+			bool kept = false;
+			for (size_t i = 0; i < tracker->current.size() && !kept; i++)
+				kept = tracker->current[i].id == tracker->previous[j].id;
+			if (!kept)
+				AddDirty(dirty, tracker->previous[j].bounds);
+		}
+		if (dirty.size() > kMaxDirtyRects) {
+			Rect box = { 0, 0, 0, 0 };
+			for (size_t i = 0; i < dirty.size(); i++)
+				box = RectUnion(box, dirty[i]);
+			dirty.assign(1, box);
+		}
+		for (size_t i = 0; i < dirty.size(); i++)
+			dirty[i] = RectClip(dirty[i], tracker->width, tracker->height);
+	}
+
+	tracker->previous.swap(tracker->current);
+	tracker->current.clear();
+	return dirty;
+}
+
+///
+// Read the dirty rectangles of the bound framebuffer straight into their
+// place in a persistent RGBA image laid out like a full glReadPixels.
+//
+void ReadDirtyRects(const std::vector<Rect> &dirty, uint8_t *image, GLsizei stride)
+{
+	glPixelStorei(GL_PACK_ROW_LENGTH, stride / 4);
+	for (size_t i = 0; i < dirty.size(); i++) {
+		const Rect &r = dirty[i];
+		glReadPixels(r.x, r.y, r.width, r.height, GL_RGBA, GL_UNSIGNED_BYTE,
+			image + (size_t)r.y * stride + (size_t)r.x * 4);
+		assertOpenGLError("glReadPixels");
+	}
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+///
+// Uniform buffer ring.
+//
+// Per-draw parameters are packed into one GL_UNIFORM_BUFFER and bound by
+// offset with glBindBufferRange, so a batch of draws costs one map, one
+// memcpy per draw and one unmap instead of several glUniform* calls each.
+// ES 3.0 has no persistent mapping, so the buffer is split into segments
+// mapped unsynchronized: a fence is inserted when the writer leaves a
+// segment and waited on before the segment is written again.
+//
+typedef struct UniformRing {
+	EGLDisplay dpy;
+	GLuint buffer;
+	GLsizeiptr segmentSize;
+	GLint alignment;            // GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	std::vector<GLFence> fences; // one per segment, unset while unused
+	size_t segment;             // segment being written
+	GLintptr offset;            // next free byte within the segment
+	GLintptr mapOffset;         // start of the mapped range, in the buffer
+	uint8_t *mapped;            // non-null between Begin and End
+} UniformRing;
+
+static const uint64_t kUniformRingWaitNs = 1000000000ull;
+
+static GLintptr AlignUp(GLintptr value, GLint alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+bool UniformRingInit(UniformRing *ring, EGLDisplay dpy, GLsizeiptr segmentSize, size_t segments,
+	GLsizeiptr blockSize)
+{
+	// Only the largest block ever bound has to fit, both in a segment and
+	// in GL_MAX_UNIFORM_BLOCK_SIZE; the segment itself may be larger
+	GLint maxBlockSize = 0;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ring->alignment);
+	glGetIntegerv(GL_MAX_UNIFORM_BLOCK_SIZE, &maxBlockSize);
+	if (ring->alignment <= 0 || blockSize > maxBlockSize || blockSize > segmentSize) {
+		printf("uniform block of %ld bytes does not fit (segment %ld, limit %d)\n",
+			(long)blockSize, (long)segmentSize, maxBlockSize);
+		return false;
+	}
+
+	ring->dpy = dpy;
+	ring->segmentSize = AlignUp(segmentSize, ring->alignment);
+	ring->fences.assign(segments, GLFence{ dpy, EGL_NO_SYNC_KHR, 0 });
+	ring->segment = 0;
+	ring->offset = 0;
+	ring->mapOffset = 0;
+	ring->mapped = nullptr;
+
+	glGenBuffers(1, &ring->buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, ring->buffer);
+	glBufferData(GL_UNIFORM_BUFFER, ring->segmentSize * segments, nullptr, GL_DYNAMIC_DRAW);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assertOpenGLError("UniformRingInit");
+	return true;
+}
+
+///
+// Map room for `bytes` of parameter blocks, moving on to the next segment
+// if the current one cannot hold them. bytes must already include the
+// alignment padding of every block, see UniformRingStride.
+//
+bool UniformRingBegin(UniformRing *ring, GLsizeiptr bytes)
+{
+	if (bytes > ring->segmentSize)
+		return false;
+
+	if (ring->offset + bytes > ring->segmentSize) {
+		// Retire the current segment and reclaim the next one
+		FenceDestroy(&ring->fences[ring->segment]);
+		ring->fences[ring->segment] = FenceCreate(ring->dpy);
+		ring->segment = (ring->segment + 1) % ring->fences.size();
+		ring->offset = 0;
+
+		GLFence *fence = &ring->fences[ring->segment];
+		if (fence->eglSync != EGL_NO_SYNC_KHR || fence->glSync) {
+			if (FenceWait(fence, kUniformRingWaitNs) != FENCE_SIGNALED)
+				printf("uniform ring segment %zu still busy\n", ring->segment);
+			FenceDestroy(fence);
+		}
+	}
+
+	ring->mapOffset = ring->segment * ring->segmentSize + ring->offset;
+	glBindBuffer(GL_UNIFORM_BUFFER, ring->buffer);
+	ring->mapped = (uint8_t *)glMapBufferRange(GL_UNIFORM_BUFFER, ring->mapOffset, bytes,
+		GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+	assertOpenGLError("glMapBufferRange");
+	return ring->mapped != nullptr;
+}
+
+///
+// Size a block of `size` bytes occupies in the ring.
+//
+GLsizeiptr UniformRingStride(const UniformRing *ring, GLsizeiptr size)
+{
+	return AlignUp(size, ring->alignment);
+}
+
+///
+// Copy one parameter block into the mapped range and return its buffer
+// offset for glBindBufferRange.
+//
+GLintptr UniformRingPush(UniformRing *ring, const void *data, GLsizeiptr size)
+{
+	GLintptr offset = ring->segment * ring->segmentSize + ring->offset;
+	memcpy(ring->mapped + (offset - ring->mapOffset), data, size);
+	ring->offset += UniformRingStride(ring, size);
+	return offset;
+}
+
+void UniformRingEnd(UniformRing *ring)
+{
+	glUnmapBuffer(GL_UNIFORM_BUFFER);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	assertOpenGLError("glUnmapBuffer");
+	ring->mapped = nullptr;
+}
+
+void UniformRingDestroy(UniformRing *ring)
+{
+	for (GLFence &fence : ring->fences)
+		FenceDestroy(&fence);
+	glDeleteBuffers(1, &ring->buffer);
+}
+
+///
+// Atlas batching.
+//
+// Packs many small render jobs into cells of one large render target, draws
+// them all in one instanced draw call (or one scissored draw per job, with
+// its parameters in a uniform block from a UniformRing), reads
+// the atlas back once and slices it into per-job images. This amortizes the
+// fixed per-draw and per-readback costs over hundreds of tiny images.
+//
+typedef struct AtlasJob {
+	GLsizei width;
+	GLsizei height;
+	GLfloat color[4];
+	GLfloat scale;  // size of the triangle within its cell, at most 1
+	Rect cell;      // placement in the atlas, filled in by AtlasPack
+} AtlasJob;
+
+typedef enum AtlasMode {
+	ATLAS_INSTANCED,
+	ATLAS_SCISSORED,
+} AtlasMode;
+
+typedef struct AtlasRenderer {
+	GLuint program;
+	GLuint blockProgram;  // reads per-job values from the AtlasParams block
+	GLuint vao;
+	GLuint vertexBuffer;
+	GLuint instanceBuffer;
+	UniformRing params;
+} AtlasRenderer;
+
+// Per-instance attributes, laid out as in instanceBuffer.
+typedef struct AtlasInstance {
+	GLfloat cell[4];  // origin and size in normalized device coordinates
+	GLfloat color[4];
+	GLfloat scale;
+} AtlasInstance;
+
+// The AtlasParams uniform block, std140 layout.
+typedef struct AtlasParams {
+	GLfloat cell[4];
+	GLfloat color[4];
+	GLfloat scale;
+	GLfloat pad[3];
+} AtlasParams;
+
+static const GLuint kAtlasParamsBinding = 0;
+
+static const char kAtlasVertexShader[] = R"(#version 300 es
+layout(location = 0) in vec2 a_position;
+layout(location = 1) in vec4 a_cell;
+layout(location = 2) in vec4 a_color;
+layout(location = 3) in float a_scale;
+out vec4 v_color;
+void main()
+{
+    v_color = a_color;
+    vec2 p = a_position * a_scale * 0.5 + 0.5;
+    gl_Position = vec4(a_cell.xy + p * a_cell.zw, 0.0, 1.0);
+})";
+
+static const char kAtlasBlockVertexShader[] = R"(#version 300 es
+layout(location = 0) in vec2 a_position;
+layout(std140) uniform AtlasParams {
+    vec4 u_cell;
+    vec4 u_color;
+    float u_scale;
+};
+out vec4 v_color;
+void main()
+{
+    v_color = u_color;
+    vec2 p = a_position * u_scale * 0.5 + 0.5;
+    gl_Position = vec4(u_cell.xy + p * u_cell.zw, 0.0, 1.0);
+})";
+
+static const char kAtlasFragmentShader[] = R"(#version 300 es
+precision mediump float;
+in vec4 v_color;
+out vec4 fragColor;
+void main()
+{
+    fragColor = v_color;
+})";
+
+///
+// Shelf-pack jobs[first..end) in order into an atlasWidth x maxHeight area.
+// Returns how many jobs were placed; *usedHeight gets the rows they cover.
+//
+size_t AtlasPack(std::vector<AtlasJob> &jobs, size_t first, size_t end, GLsizei atlasWidth,
+	GLsizei maxHeight, GLsizei *usedHeight)
+{
+	GLint x = 0, y = 0;
+	GLsizei shelfHeight = 0;
+	size_t i = first;
+
+	for (; i < end; i++) {
+		AtlasJob &job = jobs[i];
+		if (job.width > atlasWidth)
+			break;
+		if (x + job.width > atlasWidth) {
+			x = 0;
+			y += shelfHeight;
+			shelfHeight = 0;
+		}
+		if (y + job.height > maxHeight)
+			break;
+		job.cell.x = x;
+		job.cell.y = y;
+		job.cell.width = job.width;
+		job.cell.height = job.height;
+		x += job.width;
+		shelfHeight = job.height > shelfHeight ? job.height : shelfHeight;
+	}
+	*usedHeight = y + shelfHeight;
+	return i - first;
+}
+
+bool AtlasRendererInit(AtlasRenderer *renderer)
+{
+	static const GLfloat triangle[] = {
+		0.0f,  1.0f,
+		-1.0f, -1.0f,
+		1.0f,  -1.0f,
+	};
+
+	renderer->program = CompileProgram(kAtlasVertexShader, kAtlasFragmentShader);
+	renderer->blockProgram = CompileProgram(kAtlasBlockVertexShader, kAtlasFragmentShader);
+	if (!renderer->program || !renderer->blockProgram)
+		return false;
+	// Block bindings default to 0, so a driver that does not report the
+	// block still reads it from kAtlasParamsBinding
+	GLuint block = glGetUniformBlockIndex(renderer->blockProgram, "AtlasParams");
+	if (block != GL_INVALID_INDEX)
+		glUniformBlockBinding(renderer->blockProgram, block, kAtlasParamsBinding);
+	if (!UniformRingInit(&renderer->params, eglGetCurrentDisplay(), 64 * 1024, 3, sizeof(AtlasParams)))
+		return false;
+
+	glGenVertexArrays(1, &renderer->vao);
+	glBindVertexArray(renderer->vao);
+
+	glGenBuffers(1, &renderer->vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, renderer->vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+
+	glGenBuffers(1, &renderer->instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, renderer->instanceBuffer);
+	const GLsizei stride = sizeof(AtlasInstance);
+	glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(AtlasInstance, cell));
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(AtlasInstance, color));
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(AtlasInstance, scale));
+	for (GLuint attrib = 1; attrib <= 3; attrib++)
+		glVertexAttribDivisor(attrib, 1);
+
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindVertexArray(0);
+	assertOpenGLError("AtlasRendererInit");
+	return true;
+}
+
+void AtlasRendererDestroy(AtlasRenderer *renderer)
+{
+	glDeleteProgram(renderer->program);
+	glDeleteProgram(renderer->blockProgram);
+	UniformRingDestroy(&renderer->params);
+	glDeleteBuffers(1, &renderer->vertexBuffer);
+	glDeleteBuffers(1, &renderer->instanceBuffer);
+	glDeleteVertexArrays(1, &renderer->vao);
+}
+
+///
+// Draw jobs[first, first + count) into their cells of the bound atlas.
+// Instanced mode issues a single draw; cells must not overlap, and since a
+// triangle is only clipped to the whole atlas, its scale must not exceed 1.
+// Scissored mode issues one draw per job, clipped exactly to its cell, with
+// the job's parameters bound from the uniform ring.
+//
+void AtlasRender(AtlasRenderer *renderer, GLsizei atlasWidth, GLsizei atlasHeight,
+	const std::vector<AtlasJob> &jobs, size_t first, size_t count, AtlasMode mode)
+{
+	glBindVertexArray(renderer->vao);
+
+	if (mode == ATLAS_INSTANCED) {
+		glUseProgram(renderer->program);
+		std::vector<AtlasInstance> instances(count);
+		for (size_t i = 0; i < count; i++) {
+			const AtlasJob &job = jobs[first + i];
+			AtlasInstance &inst = instances[i];
+			inst.cell[0] = 2.0f * job.cell.x / atlasWidth - 1.0f;
+			inst.cell[1] = 2.0f * job.cell.y / atlasHeight - 1.0f;
+			inst.cell[2] = 2.0f * job.cell.width / atlasWidth;
+			inst.cell[3] = 2.0f * job.cell.height / atlasHeight;
+			memcpy(inst.color, job.color, sizeof(inst.color));
+			inst.scale = job.scale < 1.0f ? job.scale : 1.0f;
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, renderer->instanceBuffer);
+		glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(AtlasInstance), instances.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		for (GLuint attrib = 1; attrib <= 3; attrib++)
+			glEnableVertexAttribArray(attrib);
+		glViewport(0, 0, atlasWidth, atlasHeight);
+		glDrawArraysInstanced(GL_TRIANGLES, 0, 3, (GLsizei)count);
+		assertOpenGLError("glDrawArraysInstanced");
+	} else {
+		for (GLuint attrib = 1; attrib <= 3; attrib++)
+			glDisableVertexAttribArray(attrib);
+		glUseProgram(renderer->blockProgram);
+		glEnable(GL_SCISSOR_TEST);
+
+		// Write as many blocks as fit in a segment, then draw them
+		UniformRing *ring = &renderer->params;
+		const GLsizeiptr stride = UniformRingStride(ring, sizeof(AtlasParams));
+		const size_t perBatch = ring->segmentSize / stride;
+		std::vector<GLintptr> offsets;
+		for (size_t done = 0; done < count; ) {
+			size_t batch = count - done < perBatch ? count - done : perBatch;
+			if (!UniformRingBegin(ring, batch * stride))
+				break;
+			offsets.resize(batch);
+			for (size_t i = 0; i < batch; i++) {
+				const AtlasJob &job = jobs[first + done + i];
+				const AtlasParams params = {
+					{ -1.0f, -1.0f, 2.0f, 2.0f },
+					{ job.color[0], job.color[1], job.color[2], job.color[3] },
+					job.scale,
+					{ 0.0f, 0.0f, 0.0f },
+				};
+				offsets[i] = UniformRingPush(ring, &params, sizeof(params));
+			}
+			UniformRingEnd(ring);
+
+			for (size_t i = 0; i < batch; i++) {
+				const Rect &cell = jobs[first + done + i].cell;
+				glViewport(cell.x, cell.y, cell.width, cell.height);
+				glScissor(cell.x, cell.y, cell.width, cell.height);
+				glBindBufferRange(GL_UNIFORM_BUFFER, kAtlasParamsBinding, ring->buffer, offsets[i], sizeof(AtlasParams));
+				glDrawArrays(GL_TRIANGLES, 0, 3);
+			}
+			done += batch;
+		}
+		glDisable(GL_SCISSOR_TEST);
+		assertOpenGLError("glDrawArrays");
+	}
+
+	glBindVertexArray(0);
+}
+
+///
+// State handed to every worker thread. Workers create their contexts in the
+// share group of shareContext, so assets uploaded once by the upload thread,
+// such as sharedAsset, are visible to all of them.
+//
+typedef struct GLContext {
+    EGLDisplay dpy;
+	EGLConfig config;
+	EGLint width;
+	EGLint height;
+	EGLContext shareContext;
+	Asset *sharedAsset;
+	FrameSink *sink;  // stream frames here instead of writing img.png
+	bool gpuYUV;      // convert YUV sink frames on the GPU before readback
+	bool dirtyRects;  // only render and read back what changed since last frame
+	bool dedupe;      // skip encoding frames identical to recent ones
+	int frames;       // stop after this many frames, 0 to run forever
+	FrameRing *ring;  // publish thread A's frames here instead of encoding
+	AsyncWriter *writer;  // write atlas thumbnails through this, if set
+	ArchiveWriter *archive;  // append encoded images here instead of writing files
+	int atlasJobs;    // render this many thumbnails through an atlas instead
+	int atlasContexts;  // context threads rendering atlases
+	int cpuWorkers;   // threads encoding thumbnails besides the context threads
+	GLsizei thumbWidth;
+	GLsizei thumbHeight;
+	AtlasMode atlasMode;
+} GLContext;
+
+GLuint CreateSimpleTexture2D()
+{
+    // Use tightly packed data
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // Generate a texture object
+    GLuint texture;
+    glGenTextures(1, &texture);
+
+    // Bind the texture object
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    // Load the texture: 2x2 Image, 3 bytes per pixel (R, G, B)
+    const size_t width                 = 2;
+    const size_t height                = 2;
+    GLubyte pixels[width * height * 3] = {
+        255, 0,   0,    // Red
+        0,   255, 0,    // Green
+        0,   0,   255,  // Blue
+        255, 255, 0,    // Yellow
+    };
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
+
+    // Set the filtering mode
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    return texture;
+}
+
+///
+// Decoder for the same 2x2 image, for use with UploadQueue
+//
+bool DecodeSimpleTexture2D(void *, AssetImage *image)
+{
+    static const GLubyte pixels[] = {
+        255, 0,   0,   255,  // Red
+        0,   255, 0,   255,  // Green
+        0,   0,   255, 255,  // Blue
+        255, 255, 0,   255,  // Yellow
+    };
+    image->width = 2;
+    image->height = 2;
+    image->pixels.assign(pixels, pixels + sizeof(pixels));
+    return true;
+}
+
+// Per-job GPU deadline; jobs that have not finished by then are reported.
+static const uint64_t kJobDeadlineNs = 100 * 1000000ull;
+
+static void frame_fence_done(void *userdata, FenceStatus status, uint64_t elapsed_ns)
+{
+	int frame = (int)(intptr_t)userdata;
+
+	if (status == FENCE_SIGNALED) {
+		MetricRecord(&gMetrics.renderLatency, elapsed_ns);
+	} else {
+		MetricAdd(&gMetrics.deadlineMisses);
+		printf("frame %d missed its deadline after %.3f ms\n", frame, elapsed_ns / 1e6);
+	}
+}
+
+void *thread_func_a(void *userdata)
+{
+    
+    GLContext *glCtx = static_cast<GLContext *>(userdata);
+	EGLDisplay dpy = glCtx->dpy;
+	EGLConfig config = glCtx->config;
+	EGLSurface surface;
+	EGLContext context;
+	EGLint width = glCtx->width;
+	EGLint height = glCtx->height;
+	printf("Thread inside %#x display %p config %p width %d height %d\n",
+		gettid(), dpy, config, width, height);
+	TraceSetThreadName("render A");
+	PinThread(&gPinGL, "render A");
+	uint64_t setupStart = NowNs();
+#if 0
+	dpy = eglGetDisplay((EGLNativeDisplayType)0);
+	if (!eglInitialize(dpy, NULL, NULL)) {
+		assertEGLError("eglGetDisplay");
+		printf("failed to initialize display\n");
+		return 0;
+	}
+	const GLint configAttribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	int n;
+	if (!eglChooseConfig(dpy, configAttribs,
+		&config, 1, &n) || n == 0) {
+		assertEGLError("eglChooseConfig");
+		printf("%s: Could not find GLES 2.x config!\n", __FUNCTION__);
+		return 0;
+	}
+#endif
+	// Create a pbuffer surface
+	const EGLint pbufAttribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+    surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
+	assertEGLError("eglCreatePbufferSurface");
+	// Create a GL context
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+
+	context = eglCreateContext(dpy, config, glCtx->shareContext, contextAttribs);
+	assertEGLError("eglCreateContext");
+
+	printf("thread %lx display %p context %p surface %p\n", gettid(), dpy, context, surface);
+	// Make the context current
+	if (!eglMakeCurrent(dpy, surface, surface, context)) {
+		assertEGLError("eglMakeCurrent");
+		printf("failed to create context\n");
+		return 0;
+	}
+	TraceComplete("egl setup", "egl", setupStart);
+
+	FenceReaper reaper;
+	FenceReaperStart(&reaper, dpy, config, context);
+
+	/*
+	 * 1. Render targets come from a per-thread pool and are recycled between
+	 *    frames of the same size and format.
+	 */
+	RenderTargetPool targets;
+	RenderTargetPoolInit(&targets, 4);
+	const RenderTargetKey targetKey = { width, height, GL_RGB8, 0, GL_NONE };
+
+	/*
+	 * 2. Read the framebuffer's color attachment and save it as a PNG file.
+	 */
+	GLsizei nr_channels = 4;
+	GLsizei stride = nr_channels * width;
+	stride += (stride % 4) ? (4 - stride % 4) : 0;
+	GLsizei bufferSize = stride * height;
+	std::vector<char> buffer(bufferSize);
+
+	//
+	// intialize program data
+	//
+	constexpr char kVS[] = R"(attribute vec4 a_position;
+attribute vec2 a_texCoord;
+varying vec2 v_texCoord;
+void main()
+{
+    gl_Position = a_position;
+    v_texCoord = a_texCoord;
+})";
+
+	constexpr char kFS[] = R"(precision mediump float;
+varying vec2 v_texCoord;
+uniform sampler2D s_texture;
+void main()
+{
+    gl_FragColor = texture2D(s_texture, v_texCoord);
+})";
+	GLuint mProgram = CompileProgram(kVS, kFS);
+	if (!mProgram)
+	{
+		return 0;
+	}
+
+	// Get the attribute locations
+	GLint mPositionLoc = glGetAttribLocation(mProgram, "a_position");
+	GLint mTexCoordLoc = glGetAttribLocation(mProgram, "a_texCoord");
+
+	// Get the sampler location
+	GLint mSamplerLoc = glGetUniformLocation(mProgram, "s_texture");
+
+	// The shared texture is uploaded in the background and picked up once it
+	// lands; without a shared asset, load a private copy
+	GLuint mTexture = glCtx->sharedAsset ? 0 : CreateSimpleTexture2D();
+
+	// YUV streams can be converted on the GPU, reading back 1.5 bytes per
+	// pixel instead of 4
+	YUVConverter yuvConv;
+	std::vector<uint8_t> yuv;
+	bool gpuYUV = glCtx->gpuYUV && glCtx->sink && glCtx->sink->format != SINK_RGBA && !glCtx->ring;
+	if (gpuYUV && (width % 8 || height % 2 || !YUVConverterInit(&yuvConv))) {
+		printf("GPU YUV conversion unavailable at %dx%d, converting on the CPU\n", width, height);
+		gpuYUV = false;
+	}
+	if (gpuYUV)
+		yuv.resize((size_t)width * height * 3 / 2);
+
+	// With dirty rectangle tracking, buffer persists across frames and only
+	// the regions whose draws changed are rendered and read back into it
+	DirtyTracker tracker;
+	bool trackDirty = glCtx->dirtyRects && !gpuYUV && !glCtx->ring;
+	DirtyTrackerInit(&tracker, width, height);
+
+	// Frames identical to one of the last few reuse its encoded PNG
+	EncodeCache encodeCache;
+	EncodeCacheInit(&encodeCache, glCtx->dedupe ? 8 : 0);
+
+	// Every frame is cleared from scratch and the color attachment is only
+	// needed until it has been read back
+	const RenderPass pass = {
+		LOAD_OP_CLEAR, STORE_OP_DONT_CARE,
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		{ 0.0f, 0.0f, 0.0f, 0.0f }, 1.0f, 0,
+	};
+
+	int mRunning = 1;
+	int frame = 0;
+	while (mRunning) {
+		GLfloat vertices[] = {
+			-0.5f, 0.5f,  0.0f,  // Position 0
+			0.0f,  0.0f,         // TexCoord 0
+			-0.5f, -0.5f, 0.0f,  // Position 1
+			0.0f,  1.0f,         // TexCoord 1
+			0.5f,  -0.5f, 0.0f,  // Position 2
+			1.0f,  1.0f,         // TexCoord 2
+			0.5f,  0.5f,  0.0f,  // Position 3
+			1.0f,  0.0f          // TexCoord 3
+		};
+		GLushort indices[] = { 0, 1, 2, 0, 2, 3 };
+		TRACE_SCOPE("frame", "frame");
+		uint64_t drawStart = NowNs();
+		if (!mTexture)
+			mTexture = AssetPoll(glCtx->sharedAsset);
+
+		// Damage: the quad's bounds, keyed on its vertices and texture, and
+		// everything outside the dirty area scissored away
+		const std::vector<Rect> *dirty = nullptr;
+		if (trackDirty) {
+			uint64_t key = HashBytes(vertices, sizeof(vertices), HashBytes(&mTexture, sizeof(mTexture)));
+			DirtyTrackerAddDraw(&tracker, 0, NDCBounds(vertices, 4, 5, width, height), key);
+			dirty = &DirtyTrackerEndFrame(&tracker);
+			Rect box = { 0, 0, 0, 0 };
+			for (size_t i = 0; i < dirty->size(); i++)
+				box = RectUnion(box, (*dirty)[i]);
+			glEnable(GL_SCISSOR_TEST);
+			glScissor(box.x, box.y, box.width, box.height);
+		}
+
+		// 3. before drawing, acquire a render target and begin the pass;
+		//    this binds the framebuffer, sets the viewport and clears
+		RenderTarget target = RenderTargetAcquire(&targets, targetKey);
+		RenderPassBegin(&target, &pass);
+
+		// Use the program object
+		glUseProgram(mProgram);
+
+		// Load the vertex position
+		glVertexAttribPointer(mPositionLoc, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat), vertices);
+		// Load the texture coordinate
+		glVertexAttribPointer(mTexCoordLoc, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(GLfloat),
+			vertices + 3);
+
+		glEnableVertexAttribArray(mPositionLoc);
+		glEnableVertexAttribArray(mTexCoordLoc);
+
+		// Bind the texture
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, mTexture);
+
+		// Set the texture sampler to texture unit to 0
+		glUniform1i(mSamplerLoc, 0);
+		EGLDisplay curDisplay = eglGetCurrentDisplay();
+		EGLSurface curSurface = eglGetCurrentSurface(EGL_READ);
+		EGLContext curContext = eglGetCurrentContext();
+		printf("thread %lx display %p context %p surface %p\n", gettid(), curDisplay, curContext, curSurface);
+		glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_SHORT, indices);
+		assertOpenGLError("glDrawElements");
+		MetricAdd(&gMetrics.framesRendered);
+		TraceComplete("draw", "gl", drawStart);
+		FenceReaperSubmit(&reaper, FenceCreate(dpy), kJobDeadlineNs,
+			frame_fence_done, (void *)(intptr_t)frame++);
+		glBindTexture(GL_TEXTURE_2D, 0);
+
+		// 4. read, either as YUV planes converted on the GPU or as RGBA
+		uint64_t readStart = NowNs();
+		RenderTarget readable = RenderTargetResolve(&targets, target);
+		if (glCtx->ring) {
+			// Straight into the shared slot, no staging copy
+			uint8_t *slot = FrameRingBegin(glCtx->ring);
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, slot);
+			assertOpenGLError("glReadPixels");
+			if (gDryRun)
+				SyntheticPixels(slot, width, height, width * 4, frame);
+			MetricAdd(&gMetrics.readbackBytes, (uint64_t)width * height * 4);
+		} else if (gpuYUV) {
+			YUVConvertAndRead(&yuvConv, &targets, readable.color, width, height,
+				FrameSinkLayout(glCtx->sink), yuv.data());
+			if (gDryRun)
+				SyntheticYUV(yuv.data(), width, height, frame);
+			MetricAdd(&gMetrics.readbackBytes, yuv.size());
+		} else if (trackDirty) {
+			ReadDirtyRects(*dirty, (uint8_t *)buffer.data(), stride);
+			glDisable(GL_SCISSOR_TEST);
+			if (gDryRun)
+				SyntheticPixels((uint8_t *)buffer.data(), width, height, stride, frame);
+			for (const Rect &r : *dirty)
+				MetricAdd(&gMetrics.readbackBytes, (uint64_t)r.width * r.height * 4);
+		} else {
+			//glReadPixels: format only accepts GL_RGBA and GL_RGBA_INTEGER. 
+			//type must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_INT, GL_INT, or GL_FLOAT.
+			glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+			assertOpenGLError("glPixelStorei");
+			glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
+			assertOpenGLError("glReadPixels");
+			if (gDryRun)
+				SyntheticPixels((uint8_t *)buffer.data(), width, height, stride, frame);
+			MetricAdd(&gMetrics.readbackBytes, bufferSize);
+		}
+		MetricRecord(&gMetrics.readbackLatency, NowNs() - readStart);
+		TraceComplete("readback", "gl", readStart);
+		// end the pass, dropping the color contents, and unbind framebuffer
+		RenderTargetReleaseResolved(&targets, target, readable);
+		RenderPassEnd(&target, &pass);
+		RenderTargetRelease(&targets, target);
+		uint64_t encodeStart = NowNs();
+		if (glCtx->ring) {
+			FrameRingPublish(glCtx->ring);
+		} else if (glCtx->archive) {
+			int len = 0;
+			unsigned char *png = stbi_write_png_to_mem((const unsigned char *)buffer.data(), stride,
+				width, height, nr_channels, &len);
+			if (png && ArchiveAppend(glCtx->archive, frame, png, len))
+				MetricAdd(&gMetrics.framesEncoded);
+			else
+				printf("failed to archive frame %d\n", frame);
+			STBIW_FREE(png);
+		} else if (glCtx->sink) {
+			bool written = gpuYUV ? FrameSinkWriteYUV(glCtx->sink, yuv.data()) :
+				FrameSinkWrite(glCtx->sink, (const uint8_t *)buffer.data(), stride);
+			if (!written) {
+				printf("stream closed after %d frames\n", frame);
+				mRunning = 0;
+			}
+			MetricAdd(&gMetrics.framesEncoded);
+		} else if (dirty && dirty->empty()) {
+			printf("frame unchanged, keeping img.png\n");
+			MetricAdd(&gMetrics.framesSkipped);
+		} else {
+			switch (SavePNGCached(&encodeCache, "img.png", width, height, nr_channels, buffer.data(), stride)) {
+			case SAVE_WRITTEN:
+				printf("finish saving img.png\n");
+				MetricAdd(&gMetrics.framesEncoded);
+				break;
+			case SAVE_REUSED:
+				printf("finish saving img.png (reused encoded frame)\n");
+				MetricAdd(&gMetrics.framesSkipped);
+				break;
+			case SAVE_UNCHANGED:
+				printf("frame identical, keeping img.png\n");
+				MetricAdd(&gMetrics.framesSkipped);
+				break;
+			case SAVE_FAILED:
+				printf("failed to save img.png\n");
+				break;
+			}
+		}
+		MetricRecord(&gMetrics.encodeLatency, NowNs() - encodeStart);
+		TraceComplete("encode", "encode", encodeStart);
+		if (glCtx->frames && frame >= glCtx->frames)
+			mRunning = 0;
+	}
+	FenceReaperStop(&reaper);
+	if (gpuYUV)
+		YUVConverterDestroy(&yuvConv);
+	RenderTargetPoolDestroy(&targets);
+    glDeleteProgram(mProgram);
+	if (!glCtx->sharedAsset)
+		glDeleteTextures(1, &mTexture);
+	eglDestroySurface(dpy, surface);
+	assertEGLError("eglDestroySurface");
+	eglDestroyContext(dpy, context);
+	assertEGLError("eglDestroyContext");
+#if 0
+	eglTerminate(dpy);
+	assertEGLError("eglTerminate");
+#endif
+	return 0;
+}
+
+void *thread_func_b(void *userdata)
+{
+    GLContext *glCtx = static_cast<GLContext *>(userdata);
+	EGLDisplay dpy = glCtx->dpy;
+	EGLConfig config = glCtx->config;
+	EGLint width = glCtx->width;
+	EGLint height = glCtx->height;
+	EGLSurface surface;
+	EGLContext context;
+	printf("Thread inside %#x display %p config %p\n", gettid(), dpy, config);
+	TraceSetThreadName("render B");
+	PinThread(&gPinGL, "render B");
+	uint64_t setupStart = NowNs();
+
+	// Create a GL context
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+	context = eglCreateContext(dpy, config, glCtx->shareContext, contextAttribs);
+	assertEGLError("eglCreateContext");
+
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
+	assertEGLError("eglCreatePbufferSurface");
+	
+	eglMakeCurrent(dpy, surface, surface, context);
+	assertEGLError("eglMakeCurrent");
+	TraceComplete("egl setup", "egl", setupStart);
+	
+	/*
+	 * Acquire a render target from the pool.
+	 */
+	RenderTargetPool targets;
+	RenderTargetPoolInit(&targets, 1);
+	const RenderTargetKey targetKey = { width, height, GL_RGB8, 0, GL_NONE };
+	RenderTarget target = RenderTargetAcquire(&targets, targetKey);
+	const RenderPass pass = {
+		LOAD_OP_CLEAR, STORE_OP_DONT_CARE,
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		{ 0.0f, 0.0f, 0.0f, 0.0f }, 1.0f, 0,
+	};
+	RenderPassBegin(&target, &pass);
+	
+	/*
+	 * Render something.
+	 */
+#if 0
+	glViewport(0, 0, width, height);
+	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glFlush();
+#endif
+
+	uint64_t drawStart = NowNs();
+	draw_triangle(width, height);
+	MetricAdd(&gMetrics.framesRendered);
+	TraceComplete("draw", "gl", drawStart);
+
+	uint64_t renderStart = NowNs();
+	GLFence fence = FenceCreate(dpy);
+	if (FenceWait(&fence, kJobDeadlineNs) != FENCE_SIGNALED) {
+		MetricAdd(&gMetrics.deadlineMisses);
+		printf("thread %#x job missed its %.0f ms deadline\n", gettid(), kJobDeadlineNs / 1e6);
+	} else {
+		MetricRecord(&gMetrics.renderLatency, NowNs() - renderStart);
+	}
+	FenceDestroy(&fence);
+	TraceComplete("fence wait", "gpu", renderStart);
+
+	/*
+	 * Read the framebuffer's color attachment and save it as a PNG file.
+	 */
+	GLsizei nr_channels = 4;
+	GLsizei stride = nr_channels * width;
+	stride += (stride % 4) ? (4 - stride % 4) : 0;
+	GLsizei bufferSize = stride * height;
+	//GLsizei bufferSize = pixelDataSize(width, height, format, type);
+	vector<char> buffer(bufferSize);
+
+	//glReadPixels: format only accepts GL_RGBA and GL_RGBA_INTEGER. 
+	//type must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_INT, GL_INT, or GL_FLOAT.
+	uint64_t readStart = NowNs();
+	RenderTarget readable = RenderTargetResolve(&targets, target);
+	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
+	assertOpenGLError("glReadPixels");
+	if (gDryRun)
+		SyntheticPixels((uint8_t *)buffer.data(), width, height, stride, 0);
+	MetricRecord(&gMetrics.readbackLatency, NowNs() - readStart);
+	MetricAdd(&gMetrics.readbackBytes, bufferSize);
+	TraceComplete("readback", "gl", readStart);
+
+	RenderTargetReleaseResolved(&targets, target, readable);
+	RenderPassEnd(&target, &pass);
+	RenderTargetRelease(&targets, target);
+
+	uint64_t encodeStart = NowNs();
+	stbi_write_png("img2.png", width, height, nr_channels, buffer.data(), stride);
+	MetricRecord(&gMetrics.encodeLatency, NowNs() - encodeStart);
+	TraceComplete("encode", "encode", encodeStart);
+	MetricAdd(&gMetrics.framesEncoded);
+	
+	printf("finish saving img2.png\n");
+	/*
+	 * Destroy context.
+	 */
+	RenderTargetPoolDestroy(&targets);
+	 
+	eglDestroySurface(dpy, surface);
+	assertEGLError("eglDestroySurface");
+	
+	eglDestroyContext(dpy, context);
+	assertEGLError("eglDestroyContext");
+	return 0;
+}
+
+static void thumb_written(void *, const char *path, int64_t result)
+{
+	if (result < 0)
+		printf("failed to write %s: %s\n", path, strerror((int)-result));
+}
+
+///
+// Atlas jobs run on a Scheduler: each atlas batch is a GL task on one of
+// the context threads, and the encode of each of its cells is a CPU task
+// that idle workers steal.
+//
+typedef struct AtlasWorker {
+	GLContext *glCtx;
+	Scheduler *sched;
+	int index;
+	pthread_t thread;
+	bool ready;  // context and renderer set up
+	AtlasRenderer renderer;
+	RenderTargetPool targets;
+	TaskGroup encodes;  // cell encodes spawned by this worker's batches
+} AtlasWorker;
+
+struct AtlasBatch;
+
+typedef struct AtlasCell {
+	AtlasBatch *batch;
+	size_t index;  // into AtlasBatch::jobs
+} AtlasCell;
+
+typedef struct AtlasBatch {
+	AtlasWorker *worker;
+	const std::vector<AtlasJob> *jobs;
+	size_t first;
+	size_t count;
+	GLsizei width;
+	GLsizei height;
+	std::vector<uint8_t> pixels;
+	std::vector<AtlasCell> cells;
+	std::atomic<size_t> remaining;  // cells not yet encoded; the last one frees the batch
+} AtlasBatch;
+
+static void atlas_cell_task(void *arg)
+{
+	AtlasCell *job = static_cast<AtlasCell *>(arg);
+	AtlasBatch *batch = job->batch;
+	GLContext *glCtx = batch->worker->glCtx;
+	const size_t i = job->index;
+	const Rect &cell = (*batch->jobs)[i].cell;
+	const GLsizei stride = batch->width * 4;
+	char name[32];
+	snprintf(name, sizeof(name), "thumb_%04zu.png", i);
+	uint64_t encodeStart = NowNs();
+	const uint8_t *cellPixels = batch->pixels.data() + (size_t)cell.y * stride + (size_t)cell.x * 4;
+	if (glCtx->archive) {
+		int len = 0;
+		unsigned char *png = stbi_write_png_to_mem(cellPixels, stride, cell.width, cell.height, 4, &len);
+		if (!png || !ArchiveAppend(glCtx->archive, i, png, len))
+			printf("failed to archive thumbnail %zu\n", i);
+		STBIW_FREE(png);
+	} else if (glCtx->writer) {
+		int len = 0;
+		unsigned char *png = stbi_write_png_to_mem(cellPixels, stride, cell.width, cell.height, 4, &len);
+		uint8_t *data = png ? AsyncWriterAlloc(len) : nullptr;
+		if (data) {
+			memcpy(data, png, len);
+			AsyncWriterSubmit(glCtx->writer, name, data, len, thumb_written, nullptr);
+		}
+		STBIW_FREE(png);
+	} else {
+		stbi_write_png(name, cell.width, cell.height, 4, cellPixels, stride);
+	}
+	MetricRecord(&gMetrics.encodeLatency, NowNs() - encodeStart);
+	MetricAdd(&gMetrics.framesEncoded);
+	TraceComplete("encode", "encode", encodeStart);
+	if (batch->remaining.fetch_sub(1) == 1)
+		delete batch;
+}
+
+static void atlas_batch_task(void *arg)
+{
+	AtlasBatch *batch = static_cast<AtlasBatch *>(arg);
+	AtlasWorker *worker = batch->worker;
+	if (!worker->ready) {
+		printf("atlas context %d is not usable, dropping %zu thumbnails\n", worker->index, batch->count);
+		delete batch;
+		return;
+	}
+	// Keep at most one earlier batch of this worker waiting for its
+	// encodes, helping with them instead of reading back ahead
+	TaskGroupWait(worker->sched, &worker->encodes, (int)batch->count);
+
+	uint64_t drawStart = NowNs();
+	const RenderPass pass = {
+		LOAD_OP_CLEAR, STORE_OP_DONT_CARE,
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		{ 0.0f, 0.0f, 0.0f, 0.0f }, 1.0f, 0,
+	};
+	const RenderTargetKey key = { batch->width, batch->height, GL_RGB8, 0, GL_NONE };
+	RenderTarget atlas = RenderTargetAcquire(&worker->targets, key);
+	RenderPassBegin(&atlas, &pass);
+	AtlasRender(&worker->renderer, batch->width, batch->height, *batch->jobs, batch->first, batch->count,
+		worker->glCtx->atlasMode);
+	MetricAdd(&gMetrics.framesRendered, batch->count);
+	TraceComplete("draw atlas", "gl", drawStart);
+
+	uint64_t readStart = NowNs();
+	RenderTarget readable = RenderTargetResolve(&worker->targets, atlas);
+	batch->pixels.resize((size_t)batch->width * 4 * batch->height);
+	glReadPixels(0, 0, batch->width, batch->height, GL_RGBA, GL_UNSIGNED_BYTE, batch->pixels.data());
+	assertOpenGLError("glReadPixels");
+	if (gDryRun)
+		SyntheticPixels(batch->pixels.data(), batch->width, batch->height, batch->width * 4, batch->first);
+	MetricRecord(&gMetrics.readbackLatency, NowNs() - readStart);
+	MetricAdd(&gMetrics.readbackBytes, batch->pixels.size());
+	TraceComplete("readback", "gl", readStart);
+	RenderTargetReleaseResolved(&worker->targets, atlas, readable);
+	RenderPassEnd(&atlas, &pass);
+	RenderTargetRelease(&worker->targets, atlas);
+
+	printf("queued %zu thumbnails from a %dx%d atlas on context %d\n", batch->count,
+		batch->width, batch->height, worker->index);
+	const size_t count = batch->count;
+	batch->cells.resize(count);
+	batch->remaining.store(count);
+	for (size_t i = 0; i < count; i++) {
+		batch->cells[i] = { batch, batch->first + i };
+		SchedulerSubmit(worker->sched, atlas_cell_task, &batch->cells[i], &worker->encodes);
+	}
+}
+
+void *thread_func_atlas(void *userdata)
+{
+	AtlasWorker *worker = static_cast<AtlasWorker *>(userdata);
+	GLContext *glCtx = worker->glCtx;
+	EGLDisplay dpy = glCtx->dpy;
+	EGLConfig config = glCtx->config;
+	EGLSurface surface;
+	EGLContext context;
+	printf("Thread inside %#x display %p config %p, atlas context %d\n",
+		gettid(), dpy, config, worker->index);
+	char threadName[32];
+	snprintf(threadName, sizeof(threadName), "atlas %d", worker->index);
+	TraceSetThreadName(threadName);
+	PinThread(&gPinGL, threadName);
+	uint64_t setupStart = NowNs();
+
+	// Create a GL context; all rendering goes to atlas framebuffers
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+	context = eglCreateContext(dpy, config, glCtx->shareContext, contextAttribs);
+	assertEGLError("eglCreateContext");
+
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
+		EGL_NONE
+	};
+	surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
+	assertEGLError("eglCreatePbufferSurface");
+
+	eglMakeCurrent(dpy, surface, surface, context);
+	assertEGLError("eglMakeCurrent");
+	TraceComplete("egl setup", "egl", setupStart);
+
+	worker->ready = AtlasRendererInit(&worker->renderer);
+	RenderTargetPoolInit(&worker->targets, 2);
+
+	// Run batches until the scheduler stops, encoding in between
+	SchedulerRunGL(worker->sched, worker->index);
+
+	RenderTargetPoolDestroy(&worker->targets);
+	if (worker->ready)
+		AtlasRendererDestroy(&worker->renderer);
+	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroySurface(dpy, surface);
+	assertEGLError("eglDestroySurface");
+	eglDestroyContext(dpy, context);
+	assertEGLError("eglDestroyContext");
+	return 0;
+}
+
+///
+// Render glCtx->atlasJobs thumbnails on glCtx->atlasContexts context threads
+// and glCtx->cpuWorkers encode threads. Called on the main thread with the
+// loader context current.
+//
+void AtlasRun(GLContext *glCtx)
+{
+	printf("%d atlas jobs of %dx%d on %d contexts and %d cpu workers\n", glCtx->atlasJobs,
+		glCtx->thumbWidth, glCtx->thumbHeight, glCtx->atlasContexts, glCtx->cpuWorkers);
+
+	/*
+	 * Make up the jobs: one triangle per thumbnail in varying colors and sizes.
+	 */
+	std::vector<AtlasJob> jobs(glCtx->atlasJobs);
+	for (size_t i = 0; i < jobs.size(); i++) {
+		AtlasJob &job = jobs[i];
+		job.width = glCtx->thumbWidth;
+		job.height = glCtx->thumbHeight;
+		job.color[0] = (i % 3 == 0) ? 1.0f : 0.25f;
+		job.color[1] = (i % 3 == 1) ? 1.0f : 0.25f;
+		job.color[2] = (i % 3 == 2) ? 1.0f : 0.25f;
+		job.color[3] = 1.0f;
+		job.scale = 0.25f + 0.25f * (i % 4);
+	}
+
+	GLint maxSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+	const GLsizei atlasWidth = maxSize < 2048 ? maxSize : 2048;
+	// Square atlases, unless a single thumbnail is taller, keep readback
+	// buffers bounded however large GL_MAX_TEXTURE_SIZE is
+	const GLsizei atlasHeight = std::max(atlasWidth, glCtx->thumbHeight);
+
+	Scheduler sched;
+	SchedulerStart(&sched, glCtx->cpuWorkers, glCtx->atlasContexts);
+	std::vector<AtlasWorker> workers(glCtx->atlasContexts);
+	for (int i = 0; i < glCtx->atlasContexts; i++) {
+		AtlasWorker &worker = workers[i];
+		worker.glCtx = glCtx;
+		worker.sched = &sched;
+		worker.index = i;
+		worker.ready = false;
+		worker.encodes.pending.store(0);
+		pthread_create(&worker.thread, NULL, thread_func_atlas, &worker);
+	}
+
+	/*
+	 * Pack as many jobs per atlas as fit, but no more than an even share
+	 * per context so every context gets work, and hand the atlases to the
+	 * context threads in turn. Each reads its atlas back once and queues
+	 * the encode of every cell.
+	 */
+	const size_t perContext = (jobs.size() + glCtx->atlasContexts - 1) / glCtx->atlasContexts;
+	uint64_t start = NowNs();
+	TaskGroup batches;
+	batches.pending.store(0);
+	int next = 0;
+	for (size_t first = 0; first < jobs.size(); ) {
+		GLsizei usedHeight = 0;
+		size_t count = AtlasPack(jobs, first, std::min(jobs.size(), first + perContext), atlasWidth,
+			atlasHeight, &usedHeight);
+		if (count == 0) {
+			printf("atlas job %zu (%dx%d) does not fit\n", first, jobs[first].width, jobs[first].height);
+			break;
+		}
+		AtlasBatch *batch = new AtlasBatch();
+		batch->worker = &workers[next];
+		batch->jobs = &jobs;
+		batch->first = first;
+		batch->count = count;
+		batch->width = atlasWidth;
+		batch->height = usedHeight;
+		SchedulerSubmitGL(&sched, next, atlas_batch_task, batch, &batches);
+		next = (next + 1) % glCtx->atlasContexts;
+		first += count;
+	}
+	TaskGroupWait(&sched, &batches);
+	for (AtlasWorker &worker : workers)
+		TaskGroupWait(&sched, &worker.encodes);
+	printf("finish saving %zu thumbnails in %.3f ms, %llu encodes stolen\n", jobs.size(),
+		(NowNs() - start) / 1e6, (unsigned long long)sched.steals.load());
+
+	if (glCtx->writer) {
+		uint64_t flushStart = NowNs();
+		AsyncWriterFlush(glCtx->writer);
+		printf("%llu thumbnails written, %llu failed, %.3f ms waiting for the writer\n",
+			(unsigned long long)glCtx->writer->completed, (unsigned long long)glCtx->writer->failed,
+			(NowNs() - flushStart) / 1e6);
+	}
+	SchedulerStop(&sched);
+	for (AtlasWorker &worker : workers)
+		pthread_join(worker.thread, NULL);
+	SchedulerDestroy(&sched);
+}
+
+///
+// Program cache: programs compiled once per share group and looked up by
+// a hash of their sources.
+//
+typedef struct ProgramCacheEntry {
+	uint64_t key;
+	GLuint program;
+} ProgramCacheEntry;
+
+typedef struct ProgramCache {
+	pthread_mutex_t lock;
+	std::vector<ProgramCacheEntry> entries;
+} ProgramCache;
+
+void ProgramCacheInit(ProgramCache *cache)
+{
+	pthread_mutex_init(&cache->lock, NULL);
+}
+
+///
+// Return the program for this shader pair, compiling it on first use. The
+// program object is shared, so any context in the share group may use it.
+//
+GLuint ProgramCacheGet(ProgramCache *cache, const char *vsSource, const char *fsSource)
+{
+	uint64_t key = HashBytes(fsSource, strlen(fsSource), HashBytes(vsSource, strlen(vsSource)));
+	GLuint program = 0;
+
+	pthread_mutex_lock(&cache->lock);
+	for (const ProgramCacheEntry &entry : cache->entries) {
+		if (entry.key == key)
+			program = entry.program;
+	}
+	if (!program) {
+		program = CompileProgram(vsSource, fsSource);
+		if (program)
+			cache->entries.push_back({ key, program });
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return program;
+}
+
+void ProgramCacheDestroy(ProgramCache *cache)
+{
+	for (const ProgramCacheEntry &entry : cache->entries)
+		glDeleteProgram(entry.program);
+	cache->entries.clear();
+	pthread_mutex_destroy(&cache->lock);
+}
+
+///
+// Render server.
+//
+// A long-running mode that keeps the display, one warm context per worker
+// and the program cache around, and renders jobs received over a Unix
+// socket. A connection carries any number of fixed-size requests, each
+// answered by a fixed-size response followed by the image, or by a memfd
+// holding the image passed with SCM_RIGHTS so the client maps it instead of
+// copying it through the socket. All fields are in host byte order.
+//
+static const uint32_t kRenderRequestMagic = 0x424f4a52;   // "RJOB"
+static const uint32_t kRenderResponseMagic = 0x53455252;  // "RRES"
+static const uint16_t kRenderProtocolVersion = 1;
+
+typedef enum RenderEncoding {
+	RENDER_ENCODING_RGBA,  // raw RGBA8 rows, bottom row first
+	RENDER_ENCODING_PNG,
+} RenderEncoding;
+
+// Request and response flags.
+static const uint32_t RENDER_FLAG_SHM = 1u << 0;  // payload in a passed memfd
+
+typedef struct RenderRequest {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t width;
+	uint32_t height;
+	uint32_t encoding;
+	float color[4];
+	float scale;
+} RenderRequest;
+
+typedef struct RenderResponse {
+	uint32_t magic;
+	int32_t status;    // 0 or an errno value; no payload unless 0
+	uint32_t width;
+	uint32_t height;
+	uint32_t encoding;
+	uint32_t flags;
+	uint64_t size;     // payload bytes, inline or in the memfd
+} RenderResponse;
+
+static_assert(sizeof(RenderRequest) == 40, "RenderRequest is part of the wire protocol");
+static_assert(sizeof(RenderResponse) == 32, "RenderResponse is part of the wire protocol");
+
+static const char kServerVertexShader[] = R"(#version 300 es
+layout(location = 0) in vec2 a_position;
+layout(location = 1) in vec4 a_color;
+layout(location = 2) in float a_scale;
+flat out vec4 v_color;
+void main()
+{
+    v_color = a_color;
+    gl_Position = vec4(a_position * a_scale, 0.0, 1.0);
+})";
+
+static const char kServerFragmentShader[] = R"(#version 300 es
+precision mediump float;
+flat in vec4 v_color;
+out vec4 fragColor;
+void main()
+{
+    fragColor = v_color;
+})";
+
+// A client that stalls in the middle of a request or response is dropped
+// after this long, so it cannot hold a worker.
+static const int kServerIoTimeoutMs = 5000;
+
+typedef struct RenderServer {
+	GLContext *glCtx;
+	int listenFd;
+	int wakeFd[2];             // workers write here when they hand back a connection
+	ProgramCache programs;
+	GLint maxSize;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<int> pending;  // connections with a request waiting for a worker
+	std::vector<int> idle;     // connections polled by the accept loop
+	std::vector<int> active;   // connections a worker is serving
+	bool running;
+} RenderServer;
+
+static volatile sig_atomic_t gServerStop = 0;
+
+static void server_signal_handler(int)
+{
+	gServerStop = 1;
+}
+
+static bool ReadFull(int fd, void *data, size_t size)
+{
+	uint8_t *p = (uint8_t *)data;
+	while (size) {
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+static bool WriteFull(int fd, const void *data, size_t size)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	while (size) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+///
+// Send the response header with passFd attached as SCM_RIGHTS ancillary data.
+//
+static bool SendResponseWithFd(int fd, const RenderResponse *response, int passFd)
+{
+	struct iovec iov = { (void *)response, sizeof(*response) };
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+	return sendmsg(fd, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(*response);
+}
+
+///
+// Create a memfd of `size` bytes mapped for writing.
+//
+static int CreateSharedBuffer(size_t size, uint8_t **mapped)
+{
+	int fd = memfd_create("render-frame", MFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	void *p = MAP_FAILED;
+	if (ftruncate(fd, size) == 0)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	*mapped = (uint8_t *)p;
+	return fd;
+}
+
+// Workers share one program, and uniform values live in the program object,
+// so per-request parameters go through the current values of the disabled
+// color and scale attributes instead, which belong to each worker's context.
+static const GLuint kServerColorAttrib = 1;
+static const GLuint kServerScaleAttrib = 2;
+
+typedef struct RenderWorker {
+	RenderServer *server;
+	GLuint program;
+	GLuint vao;
+	GLuint vertexBuffer;
+	RenderTargetPool targets;
+	std::vector<uint8_t> pixels;
+} RenderWorker;
+
+///
+// Render one request and answer it. Returns false if the connection broke
+// or the client does not speak the protocol.
+//
+static bool RenderServerHandle(RenderWorker *worker, int fd, const RenderRequest &request)
+{
+	RenderResponse response = { kRenderResponseMagic, 0, request.width, request.height,
+		request.encoding, 0, 0 };
+
+	if (request.magic != kRenderRequestMagic || request.version != kRenderProtocolVersion)
+		return false;
+	if (request.width == 0 || request.height == 0 ||
+			request.width > (uint32_t)worker->server->maxSize ||
+			request.height > (uint32_t)worker->server->maxSize ||
+			request.encoding > RENDER_ENCODING_PNG) {
+		response.status = EINVAL;
+		return WriteFull(fd, &response, sizeof(response));
+	}
 
-	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
-	assertOpenGLError("glTexImage2D");
-	
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_MIN_FILTER");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_MAG_FILTER");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_WRAP_S");
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	assertOpenGLError("glTexParameteri GL_TEXTURE_WRAP_T");
-	glBindTexture(GL_TEXTURE_2D, 0);
-	assertOpenGLError("glBindTexture");
-	/*
-	 * Attach the texture to the framebuffer.
-	 */
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
-	assertOpenGLError("glFramebufferTexture2D");
-	
-	/*
-	 * Render something.
-	 */
-#if 0
-	glViewport(0, 0, width, height);
-	glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glFlush();
-#endif
+	TRACE_SCOPE("request", "server");
+	const GLsizei width = request.width, height = request.height;
+	const size_t rgbaSize = (size_t)width * height * 4;
+	const bool shm = request.flags & RENDER_FLAG_SHM;
 
-	draw_triangle(width, height);
+	uint64_t drawStart = NowNs();
+	const RenderTargetKey key = { width, height, GL_RGBA8, 0, GL_NONE };
+	const RenderPass pass = {
+		LOAD_OP_CLEAR, STORE_OP_DONT_CARE,
+		LOAD_OP_DONT_CARE, STORE_OP_DONT_CARE,
+		{ 0.0f, 0.0f, 0.0f, 0.0f }, 1.0f, 0,
+	};
+	RenderTarget target = RenderTargetAcquire(&worker->targets, key);
+	RenderPassBegin(&target, &pass);
+	glUseProgram(worker->program);
+	glVertexAttrib4fv(kServerColorAttrib, request.color);
+	glVertexAttrib1f(kServerScaleAttrib, request.scale);
+	glBindVertexArray(worker->vao);
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	glBindVertexArray(0);
+	assertOpenGLError("glDrawArrays");
+	MetricAdd(&gMetrics.framesRendered);
+	TraceComplete("draw", "gl", drawStart);
 
-	/*
-	 * Read the framebuffer's color attachment and save it as a PNG file.
-	 */
-	GLsizei nr_channels = 4;
-	GLsizei stride = nr_channels * width;
-	stride += (stride % 4) ? (4 - stride % 4) : 0;
-	GLsizei bufferSize = stride * height;
-	//GLsizei bufferSize = pixelDataSize(width, height, format, type);
-	vector<char> buffer(bufferSize);
+	// Raw frames going to shared memory are read straight into it
+	int shmFd = -1;
+	uint8_t *shmData = nullptr;
+	uint8_t *dst;
+	if (shm && request.encoding == RENDER_ENCODING_RGBA) {
+		shmFd = CreateSharedBuffer(rgbaSize, &shmData);
+		dst = shmData;
+	} else {
+		worker->pixels.resize(rgbaSize);
+		dst = worker->pixels.data();
+	}
 
-	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
-	assertOpenGLError("glBindFramebuffer");
-	
-	//glReadPixels: format only accepts GL_RGBA and GL_RGBA_INTEGER. 
-	//type must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_INT, GL_INT, or GL_FLOAT.
-	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
-	assertOpenGLError("glReadPixels");
+	uint64_t readStart = NowNs();
+	RenderTarget readable = RenderTargetResolve(&worker->targets, target);
+	if (dst) {
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+		assertOpenGLError("glReadPixels");
+		if (gDryRun)
+			SyntheticPixels(dst, width, height, width * 4, (uint64_t)(request.color[0] * 255.0f));
+		MetricAdd(&gMetrics.readbackBytes, rgbaSize);
+	}
+	MetricRecord(&gMetrics.readbackLatency, NowNs() - readStart);
+	TraceComplete("readback", "gl", readStart);
+	RenderTargetReleaseResolved(&worker->targets, target, readable);
+	RenderPassEnd(&target, &pass);
+	RenderTargetRelease(&worker->targets, target);
 
-	stbi_write_png("img2.png", width, height, nr_channels, buffer.data(), stride);
-	
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	printf("finish saving img2.png\n");
-	/*
-	 * Destroy context.
-	 */
-	glDeleteFramebuffers(1, &frameBuffer);
-	glDeleteTextures(1, &tex);
-	 
+	const uint8_t *payload = dst;
+	size_t payloadSize = rgbaSize;
+	unsigned char *png = nullptr;
+	if (request.encoding == RENDER_ENCODING_PNG) {
+		uint64_t encodeStart = NowNs();
+		int len = 0;
+		png = stbi_write_png_to_mem(worker->pixels.data(), width * 4, width, height, 4, &len);
+		payload = png;
+		payloadSize = len;
+		MetricRecord(&gMetrics.encodeLatency, NowNs() - encodeStart);
+		MetricAdd(&gMetrics.framesEncoded);
+		TraceComplete("encode", "encode", encodeStart);
+		if (png && shm) {
+			shmFd = CreateSharedBuffer(payloadSize, &shmData);
+			if (shmFd >= 0)
+				memcpy(shmData, png, payloadSize);
+		}
+	}
+	if (shmData)
+		munmap(shmData, payloadSize);
+
+	bool ok;
+	if (!payload || (shm && shmFd < 0)) {
+		response.status = ENOMEM;
+		ok = WriteFull(fd, &response, sizeof(response));
+	} else if (shm) {
+		response.flags = RENDER_FLAG_SHM;
+		response.size = payloadSize;
+		ok = SendResponseWithFd(fd, &response, shmFd);
+	} else {
+		response.size = payloadSize;
+		ok = WriteFull(fd, &response, sizeof(response)) && WriteFull(fd, payload, payloadSize);
+	}
+	if (shmFd >= 0)
+		close(shmFd);
+	if (png)
+		STBIW_FREE(png);
+	return ok;
+}
+
+static void *render_worker_func(void *userdata)
+{
+	RenderServer *server = static_cast<RenderServer *>(userdata);
+	GLContext *glCtx = server->glCtx;
+	EGLDisplay dpy = glCtx->dpy;
+	TraceSetThreadName("server worker");
+	PinThread(&gPinGL, "server worker");
+
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
+		EGL_NONE
+	};
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(dpy, glCtx->config, glCtx->shareContext, contextAttribs);
+	assertEGLError("eglCreateContext");
+	EGLSurface surface = eglCreatePbufferSurface(dpy, glCtx->config, pbufAttribs);
+	assertEGLError("eglCreatePbufferSurface");
+	eglMakeCurrent(dpy, surface, surface, context);
+	assertEGLError("eglMakeCurrent");
+
+	static const GLfloat triangle[] = {
+		0.0f,  0.5f,
+		-0.5f, -0.5f,
+		0.5f,  -0.5f,
+	};
+	RenderWorker worker;
+	worker.server = server;
+	worker.program = ProgramCacheGet(&server->programs, kServerVertexShader, kServerFragmentShader);
+	glGenVertexArrays(1, &worker.vao);
+	glBindVertexArray(worker.vao);
+	glGenBuffers(1, &worker.vertexBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, worker.vertexBuffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(triangle), triangle, GL_STATIC_DRAW);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(0);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	RenderTargetPoolInit(&worker.targets, 4);
+
+	pthread_mutex_lock(&server->lock);
+	while (server->running) {
+		if (server->pending.empty()) {
+			pthread_cond_wait(&server->cond, &server->lock);
+			continue;
+		}
+		int fd = server->pending.front();
+		server->pending.erase(server->pending.begin());
+		server->active.push_back(fd);
+		pthread_mutex_unlock(&server->lock);
+
+		// Serve the requests already sent, then hand the connection back to
+		// the accept loop rather than waiting on a client that went quiet
+		bool open = true;
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		do {
+			RenderRequest request;
+			open = worker.program && ReadFull(fd, &request, sizeof(request)) &&
+				RenderServerHandle(&worker, fd, request);
+		} while (open && !gServerStop && poll(&pfd, 1, 0) > 0);
+
+		pthread_mutex_lock(&server->lock);
+		server->active.erase(std::find(server->active.begin(), server->active.end(), fd));
+		if (open && server->running) {
+			server->idle.push_back(fd);
+			char wake = 0;
+			ssize_t written = write(server->wakeFd[1], &wake, 1);
+			(void)written;
+		} else {
+			close(fd);
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	RenderTargetPoolDestroy(&worker.targets);
+	glDeleteBuffers(1, &worker.vertexBuffer);
+	glDeleteVertexArrays(1, &worker.vao);
+	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
 	eglDestroySurface(dpy, surface);
-	assertEGLError("eglDestroySurface");
-	
 	eglDestroyContext(dpy, context);
-	assertEGLError("eglDestroyContext");
 	return 0;
 }
 
-int main() {
+///
+// Serve render requests on socketPath with `workers` warm contexts until
+// SIGINT or SIGTERM. The accept loop polls every open connection and hands
+// the ones with a request waiting to idle workers in order, so quiet clients
+// hold no worker.
+//
+bool RenderServerRun(GLContext *glCtx, const char *socketPath, int workers)
+{
+	RenderServer server;
+	server.glCtx = glCtx;
+	server.running = true;
+	glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &server.maxSize);
+	ProgramCacheInit(&server.programs);
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		printf("server socket path too long: %s\n", socketPath);
+		return false;
+	}
+	strcpy(addr.sun_path, socketPath);
+	unlink(socketPath);
+	server.listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (server.listenFd < 0 || bind(server.listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+			listen(server.listenFd, 64) != 0) {
+		printf("cannot listen on %s: %s\n", socketPath, strerror(errno));
+		return false;
+	}
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = server_signal_handler;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	if (pipe2(server.wakeFd, O_CLOEXEC | O_NONBLOCK) != 0) {
+		printf("cannot create server pipe: %s\n", strerror(errno));
+		close(server.listenFd);
+		return false;
+	}
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.cond, NULL);
+	std::vector<pthread_t> threads(workers);
+	for (pthread_t &thread : threads)
+		pthread_create(&thread, NULL, render_worker_func, &server);
+	printf("serving %d workers on %s\n", workers, socketPath);
+
+	const struct timeval ioTimeout = { kServerIoTimeoutMs / 1000, (kServerIoTimeoutMs % 1000) * 1000 };
+	std::vector<struct pollfd> pfds;
+	while (!gServerStop) {
+		pfds.clear();
+		pfds.push_back({ server.listenFd, POLLIN, 0 });
+		pfds.push_back({ server.wakeFd[0], POLLIN, 0 });
+		pthread_mutex_lock(&server.lock);
+		for (int fd : server.idle)
+			pfds.push_back({ fd, POLLIN, 0 });
+		pthread_mutex_unlock(&server.lock);
+		if (poll(pfds.data(), pfds.size(), 200) <= 0)
+			continue;
+
+		if (pfds[1].revents) {
+			char drain[64];
+			while (read(server.wakeFd[0], drain, sizeof(drain)) > 0) {
+			}
+		}
+		pthread_mutex_lock(&server.lock);
+		for (size_t i = 2; i < pfds.size(); i++) {
+			if (!pfds[i].revents)
+				continue;
+			// Readable or hung up: a worker reads the request or the EOF
+			server.idle.erase(std::find(server.idle.begin(), server.idle.end(), pfds[i].fd));
+			server.pending.push_back(pfds[i].fd);
+			pthread_cond_signal(&server.cond);
+		}
+		pthread_mutex_unlock(&server.lock);
+
+		if (pfds[0].revents) {
+			int fd = accept4(server.listenFd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &ioTimeout, sizeof(ioTimeout));
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &ioTimeout, sizeof(ioTimeout));
+			pthread_mutex_lock(&server.lock);
+			server.idle.push_back(fd);
+			pthread_mutex_unlock(&server.lock);
+		}
+	}
+	printf("server shutting down\n");
+
+	// Wake workers blocked on a client; the request in hand fails
+	pthread_mutex_lock(&server.lock);
+	server.running = false;
+	for (int fd : server.active)
+		shutdown(fd, SHUT_RDWR);
+	pthread_cond_broadcast(&server.cond);
+	pthread_mutex_unlock(&server.lock);
+	for (pthread_t thread : threads)
+		pthread_join(thread, NULL);
+	for (int fd : server.pending)
+		close(fd);
+	for (int fd : server.idle)
+		close(fd);
+
+	close(server.wakeFd[0]);
+	close(server.wakeFd[1]);
+	close(server.listenFd);
+	unlink(socketPath);
+	ProgramCacheDestroy(&server.programs);
+	pthread_mutex_destroy(&server.lock);
+	pthread_cond_destroy(&server.cond);
+	return true;
+}
+
+///
+// Client side of the render server: send `count` requests over one
+// connection and keep the last image in outPath.
+//
+bool RenderClientRun(const char *socketPath, uint32_t width, uint32_t height, int count,
+	RenderEncoding encoding, bool shm, const char *outPath)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		printf("cannot connect to %s: %s\n", socketPath, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	std::vector<uint8_t> image;
+	uint64_t total_ns = 0;
+	bool ok = true;
+	for (int i = 0; i < count && ok; i++) {
+		RenderRequest request = { kRenderRequestMagic, kRenderProtocolVersion,
+			(uint16_t)(shm ? RENDER_FLAG_SHM : 0), width, height, (uint32_t)encoding,
+			{ (i % 3 == 0) ? 1.0f : 0.0f, (i % 3 == 1) ? 1.0f : 0.0f, (i % 3 == 2) ? 1.0f : 0.0f, 1.0f },
+			1.0f };
+		uint64_t start = NowNs();
+		RenderResponse response;
+		int passedFd = -1;
+		if (!WriteFull(fd, &request, sizeof(request))) {
+			ok = false;
+			break;
+		}
+
+		// The header may carry a descriptor, so read it with recvmsg
+		struct iovec iov = { &response, sizeof(response) };
+		union {
+			char buf[CMSG_SPACE(sizeof(int))];
+			struct cmsghdr align;
+		} control;
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		if (recvmsg(fd, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(response) ||
+				response.magic != kRenderResponseMagic) {
+			printf("bad response from %s\n", socketPath);
+			ok = false;
+			break;
+		}
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(&passedFd, CMSG_DATA(cmsg), sizeof(int));
+
+		if (response.status != 0) {
+			printf("request %d failed: %s\n", i, strerror(response.status));
+			ok = false;
+		} else if (response.flags & RENDER_FLAG_SHM) {
+			void *p = passedFd >= 0 ?
+				mmap(NULL, response.size, PROT_READ, MAP_SHARED, passedFd, 0) : MAP_FAILED;
+			if (p == MAP_FAILED) {
+				ok = false;
+			} else {
+				if (i == count - 1)
+					image.assign((const uint8_t *)p, (const uint8_t *)p + response.size);
+				munmap(p, response.size);
+			}
+		} else {
+			image.resize(response.size);
+			ok = ReadFull(fd, image.data(), image.size());
+		}
+		if (passedFd >= 0)
+			close(passedFd);
+		total_ns += NowNs() - start;
+	}
+	close(fd);
+	if (!ok)
+		return false;
+
+	printf("%d requests of %ux%u, %.3f ms per request\n", count, width, height, total_ns / 1e6 / count);
+	if (outPath) {
+		bool saved = encoding == RENDER_ENCODING_PNG ?
+			WriteFile(outPath, image.data(), image.size()) :
+			stbi_write_png(outPath, width, height, 4, image.data(), width * 4) != 0;
+		if (!saved)
+			return false;
+		printf("finish saving %s\n", outPath);
+	}
+	return true;
+}
+
+///
+// Display selection.
+//
+// eglGetDisplay(EGL_DEFAULT_DISPLAY) leaves the backend to the environment.
+// Named backends go through eglGetPlatformDisplayEXT instead: ANGLE's
+// renderers via EGL_ANGLE_platform_angle, or Mesa's surfaceless platform.
+// "auto" probes every backend the client extensions allow, benchmarks a
+// short render and readback loop on each, and keeps the fastest.
+//
+typedef struct DisplayBackend {
+	const char *name;
+	EGLenum platform;  // 0 for eglGetDisplay(EGL_DEFAULT_DISPLAY)
+	const char *extension;  // client extension the platform needs
+	EGLint attribs[9];
+	bool rasterizes;  // false for backends that skip all rendering
+} DisplayBackend;
+
+static const DisplayBackend kDisplayBackends[] = {
+	{ "default", 0, nullptr, { EGL_NONE }, true },
+	{ "vulkan", EGL_PLATFORM_ANGLE_ANGLE, "EGL_ANGLE_platform_angle_vulkan",
+		{ EGL_PLATFORM_ANGLE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_TYPE_VULKAN_ANGLE,
+		  EGL_PLATFORM_ANGLE_NATIVE_PLATFORM_TYPE_ANGLE, EGL_PLATFORM_SURFACELESS_MESA, EGL_NONE }, true },
+	{ "swiftshader", EGL_PLATFORM_ANGLE_ANGLE, "EGL_ANGLE_platform_angle_device_type_swiftshader",
+		{ EGL_PLATFORM_ANGLE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_TYPE_VULKAN_ANGLE,
+		  EGL_PLATFORM_ANGLE_DEVICE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_DEVICE_TYPE_SWIFTSHADER_ANGLE,
+		  EGL_PLATFORM_ANGLE_NATIVE_PLATFORM_TYPE_ANGLE, EGL_PLATFORM_SURFACELESS_MESA, EGL_NONE }, true },
+	{ "gles", EGL_PLATFORM_ANGLE_ANGLE, "EGL_ANGLE_platform_angle_device_type_egl_angle",
+		{ EGL_PLATFORM_ANGLE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_TYPE_OPENGLES_ANGLE,
+		  EGL_PLATFORM_ANGLE_DEVICE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_DEVICE_TYPE_EGL_ANGLE, EGL_NONE }, true },
+	{ "opengl", EGL_PLATFORM_ANGLE_ANGLE, "EGL_ANGLE_platform_angle_opengl",
+		{ EGL_PLATFORM_ANGLE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_TYPE_OPENGL_ANGLE, EGL_NONE }, true },
+	{ "null", EGL_PLATFORM_ANGLE_ANGLE, "EGL_ANGLE_platform_angle_null",
+		{ EGL_PLATFORM_ANGLE_TYPE_ANGLE, EGL_PLATFORM_ANGLE_TYPE_NULL_ANGLE, EGL_NONE }, false },
+	{ "surfaceless", EGL_PLATFORM_SURFACELESS_MESA, "EGL_MESA_platform_surfaceless", { EGL_NONE }, true },
+};
+
+static const EGLint kDisplayConfigAttribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 8,
+	EGL_GREEN_SIZE, 8,
+	EGL_BLUE_SIZE, 8,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
+	EGL_NONE
+};
+
+const DisplayBackend *FindDisplayBackend(const char *name)
+{
+	for (const DisplayBackend &backend : kDisplayBackends) {
+		if (!strcmp(backend.name, name))
+			return &backend;
+	}
+	return nullptr;
+}
+
+///
+// ANGLE context virtualization: when on, all contexts of a display share
+// one native context and ANGLE switches state between them itself, which
+// makes contexts cheap to create and switch. VIRTUALIZE_DEFAULT leaves the
+// choice to the backend.
+//
+typedef enum ContextVirtualization {
+	VIRTUALIZE_DEFAULT,
+	VIRTUALIZE_OFF,
+	VIRTUALIZE_ON,
+} ContextVirtualization;
+
+///
+// Get and initialize the display of a backend, or EGL_NO_DISPLAY if this
+// EGL does not offer it. Errors are cleared rather than fatal, so callers
+// can try the next backend.
+//
+EGLDisplay OpenDisplay(const DisplayBackend *backend, ContextVirtualization virtualization = VIRTUALIZE_DEFAULT)
+{
+	EGLenum platform = backend->platform;
+	std::vector<EGLint> attribs;
+	for (const EGLint *a = backend->attribs; *a != EGL_NONE; a += 2) {
+		attribs.push_back(a[0]);
+		attribs.push_back(a[1]);
+	}
+	const char *extension = backend->extension;
+	if (virtualization != VIRTUALIZE_DEFAULT) {
+		// The default display has no attributes; ask ANGLE for its default renderer
+		if (platform == 0) {
+			platform = EGL_PLATFORM_ANGLE_ANGLE;
+			attribs.push_back(EGL_PLATFORM_ANGLE_TYPE_ANGLE);
+			attribs.push_back(EGL_PLATFORM_ANGLE_TYPE_DEFAULT_ANGLE);
+		}
+		if (platform != EGL_PLATFORM_ANGLE_ANGLE)
+			return EGL_NO_DISPLAY;
+		attribs.push_back(EGL_PLATFORM_ANGLE_CONTEXT_VIRTUALIZATION_ANGLE);
+		attribs.push_back(virtualization == VIRTUALIZE_ON ? EGL_TRUE : EGL_FALSE);
+		extension = "EGL_ANGLE_platform_angle_context_virtualization";
+	}
+	attribs.push_back(EGL_NONE);
+
+	EGLDisplay dpy;
+	if (platform == 0) {
+		dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	} else {
+		const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+		if (!clientExtensions || !getPlatformDisplay || !strstr(clientExtensions, extension) ||
+				(backend->extension && !strstr(clientExtensions, backend->extension))) {
+			eglGetError();
+			return EGL_NO_DISPLAY;
+		}
+		dpy = getPlatformDisplay(platform, (void *)EGL_DEFAULT_DISPLAY, attribs.data());
+	}
+	if (dpy == EGL_NO_DISPLAY || !eglInitialize(dpy, nullptr, nullptr)) {
+		eglGetError();
+		return EGL_NO_DISPLAY;
+	}
+	return dpy;
+}
+
+///
+// Time a render and readback loop on an initialized display; returns
+// milliseconds per frame, or a negative value if no ES3 context could be
+// made.
+//
+double ProbeDisplay(EGLDisplay dpy)
+{
+	static const GLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+	static const EGLint pbufAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+	const GLsizei size = 512;
+	const int frames = 20;
+
+	EGLConfig config;
+	EGLint count = 0;
+	if (!eglChooseConfig(dpy, kDisplayConfigAttribs, &config, 1, &count) || count == 0) {
+		eglGetError();
+		return -1.0;
+	}
+	eglBindAPI(EGL_OPENGL_ES_API);
+	EGLContext context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+	EGLSurface surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
+	if (context == EGL_NO_CONTEXT || surface == EGL_NO_SURFACE ||
+			!eglMakeCurrent(dpy, surface, surface, context)) {
+		eglGetError();
+		if (surface != EGL_NO_SURFACE)
+			eglDestroySurface(dpy, surface);
+		if (context != EGL_NO_CONTEXT)
+			eglDestroyContext(dpy, context);
+		return -1.0;
+	}
+
+	const char vs[] =
+		"#version 300 es\n"
+		"layout(location = 0) in vec4 position;\n"
+		"void main() { gl_Position = position; }\n";
+	const char fs[] =
+		"#version 300 es\n"
+		"precision mediump float;\n"
+		"out vec4 color;\n"
+		"void main() { color = vec4(gl_FragCoord.xy / 512.0, 0.5, 1.0); }\n";
+	static const GLfloat vertices[] = { -1.0f, -1.0f, 3.0f, -1.0f, -1.0f, 3.0f };
+	GLuint program = CompileProgram(vs, fs);
+	GLuint texture, fbo;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, size, size);
+	glGenFramebuffers(1, &fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+	glViewport(0, 0, size, size);
+	glUseProgram(program);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, vertices);
+	glEnableVertexAttribArray(0);
+
+	std::vector<uint8_t> pixels((size_t)size * size * 4);
+	uint64_t start = 0;
+	for (int frame = 0; frame <= frames; frame++) {
+		// The first frame warms up shader compilation and allocation
+		if (frame == 1)
+			start = NowNs();
+		glClear(GL_COLOR_BUFFER_BIT);
+		for (int layer = 0; layer < 8; layer++)
+			glDrawArrays(GL_TRIANGLES, 0, 3);
+		glReadPixels(0, 0, size, size, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+	}
+	double msPerFrame = (NowNs() - start) / 1e6 / frames;
+	bool ok = glGetError() == GL_NO_ERROR && glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+
+	glDeleteFramebuffers(1, &fbo);
+	glDeleteTextures(1, &texture);
+	glDeleteProgram(program);
+	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroySurface(dpy, surface);
+	eglDestroyContext(dpy, context);
+	eglGetError();
+	return ok ? msPerFrame : -1.0;
+}
+
+///
+// Open the display named by name ("auto" to probe) with the given context
+// virtualization. Prints why and returns
+// EGL_NO_DISPLAY if nothing usable is found.
+//
+EGLDisplay SelectDisplay(const char *name, ContextVirtualization virtualization)
+{
+	if (strcmp(name, "auto")) {
+		const DisplayBackend *backend = FindDisplayBackend(name);
+		if (!backend) {
+			printf("unknown display backend %s\n", name);
+			return EGL_NO_DISPLAY;
+		}
+		EGLDisplay dpy = OpenDisplay(backend, virtualization);
+		if (dpy == EGL_NO_DISPLAY)
+			printf("display backend %s is not available%s\n", name,
+				virtualization != VIRTUALIZE_DEFAULT ? " with this context virtualization" : "");
+		return dpy;
+	}
+
+	// Rasterizing backends only: the null one would always win
+	const DisplayBackend *best = nullptr;
+	double bestMs = 0.0;
+	for (const DisplayBackend &backend : kDisplayBackends) {
+		if (!backend.rasterizes)
+			continue;
+		EGLDisplay dpy = OpenDisplay(&backend, virtualization);
+		if (dpy == EGL_NO_DISPLAY) {
+			printf("probe %-12s unavailable\n", backend.name);
+			continue;
+		}
+		double ms = ProbeDisplay(dpy);
+		const char *vendorString = eglQueryString(dpy, EGL_VENDOR);
+		std::string vendor = vendorString ? vendorString : "unknown vendor";
+		eglTerminate(dpy);
+		eglGetError();
+		if (ms < 0.0) {
+			printf("probe %-12s no usable ES3 context\n", backend.name);
+			continue;
+		}
+		printf("probe %-12s %8.3f ms/frame (%s)\n", backend.name, ms, vendor.c_str());
+		if (!best || ms < bestMs) {
+			best = &backend;
+			bestMs = ms;
+		}
+	}
+	if (!best) {
+		printf("no display backend is usable\n");
+		return EGL_NO_DISPLAY;
+	}
+	printf("using display backend %s\n", best->name);
+	return OpenDisplay(best, virtualization);
+}
+
+///
+// Context benchmark: for each worker count, create that many independent
+// contexts, switch one thread through all of them, then render from one
+// thread per context at once, with context virtualization off and on.
+//
+typedef struct ContextBenchWorker {
+	EGLDisplay dpy;
+	EGLContext context;
+	EGLSurface surface;
+	int frames;
+	pthread_t thread;
+} ContextBenchWorker;
+
+static const GLsizei kContextBenchSize = 64;
+
+// A trivial draw that does not wait for the GPU.
+static void ContextBenchClear(int frame)
+{
+	glClearColor((frame & 1) ? 1.0f : 0.0f, 0.5f, 0.25f, 1.0f);
+	glClear(GL_COLOR_BUFFER_BIT);
+}
+
+static void ContextBenchFrame(int frame, uint8_t *pixels)
+{
+	ContextBenchClear(frame);
+	glReadPixels(0, 0, kContextBenchSize, kContextBenchSize, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+}
+
+static void *context_bench_func(void *userdata)
+{
+	ContextBenchWorker *worker = static_cast<ContextBenchWorker *>(userdata);
+	std::vector<uint8_t> pixels((size_t)kContextBenchSize * kContextBenchSize * 4);
+	eglMakeCurrent(worker->dpy, worker->surface, worker->surface, worker->context);
+	for (int frame = 0; frame < worker->frames; frame++)
+		ContextBenchFrame(frame, pixels.data());
+	eglMakeCurrent(worker->dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	return NULL;
+}
+
+///
+// Parse a --bench-contexts list such as "1,2,4,8"; every entry must be a
+// positive count.
+//
+bool ParseContextCounts(const char *spec, std::vector<int> *counts)
+{
+	counts->clear();
+	for (const char *p = spec; ; ) {
+		char *end;
+		long count = strtol(p, &end, 10);
+		if (end == p || count <= 0 || count > 4096 || (*end && *end != ','))
+			return false;
+		counts->push_back((int)count);
+		if (!*end)
+			return true;
+		p = end + 1;
+	}
+}
+
+bool BenchContexts(const char *name, const std::vector<int> &counts)
+{
+	static const GLint contextAttribs[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, kContextBenchSize,
+		EGL_HEIGHT, kContextBenchSize,
+		EGL_NONE
+	};
+	const DisplayBackend *backend = FindDisplayBackend(name);
+	if (!backend) {
+		printf("unknown display backend %s\n", name);
+		return false;
+	}
+
+	printf("%-12s %8s %14s %14s %14s\n", "contexts", "count", "create ms/ctx", "switch us", "frames/s");
+	bool any = false;
+	const ContextVirtualization modes[] = { VIRTUALIZE_OFF, VIRTUALIZE_ON };
+	for (ContextVirtualization mode : modes) {
+		const char *modeName = mode == VIRTUALIZE_ON ? "virtualized" : "physical";
+		EGLDisplay dpy = OpenDisplay(backend, mode);
+		EGLConfig config;
+		EGLint numConfig = 0;
+		if (dpy == EGL_NO_DISPLAY ||
+				!eglChooseConfig(dpy, kDisplayConfigAttribs, &config, 1, &numConfig) || numConfig == 0) {
+			eglGetError();
+			printf("%-12s not available on %s\n", modeName, name);
+			if (dpy != EGL_NO_DISPLAY)
+				eglTerminate(dpy);
+			continue;
+		}
+		eglBindAPI(EGL_OPENGL_ES_API);
+
+		for (int count : counts) {
+			std::vector<ContextBenchWorker> workers(count);
+			uint64_t createStart = NowNs();
+			int created = 0;
+			for (ContextBenchWorker &worker : workers) {
+				worker.dpy = dpy;
+				worker.context = eglCreateContext(dpy, config, EGL_NO_CONTEXT, contextAttribs);
+				worker.surface = eglCreatePbufferSurface(dpy, config, pbufAttribs);
+				if (worker.context == EGL_NO_CONTEXT || worker.surface == EGL_NO_SURFACE)
+					break;
+				created++;
+			}
+			double createMs = (NowNs() - createStart) / 1e6 / (created ? created : 1);
+
+			double switchUs = 0.0, framesPerSecond = 0.0;
+			if (created == count) {
+				// One thread visiting every context in turn, about 1000 switches,
+				// each followed by a clear so the switch is not optimized away.
+				// The same clears on one context without switching are the
+				// baseline subtracted from it.
+				const int rounds = count < 1000 ? 1000 / count : 1;
+				const double switches = (double)rounds * count;
+				eglMakeCurrent(dpy, workers[0].surface, workers[0].surface, workers[0].context);
+				glFinish();
+				uint64_t baselineStart = NowNs();
+				for (int n = 0; n < rounds * count; n++)
+					ContextBenchClear(n);
+				const double baselineUs = (NowNs() - baselineStart) / 1e3;
+				glFinish();
+				uint64_t switchStart = NowNs();
+				for (int round = 0; round < rounds; round++) {
+					for (ContextBenchWorker &worker : workers) {
+						eglMakeCurrent(dpy, worker.surface, worker.surface, worker.context);
+						ContextBenchClear(round);
+					}
+				}
+				const double switchTotalUs = (NowNs() - switchStart) / 1e3;
+				for (ContextBenchWorker &worker : workers) {
+					eglMakeCurrent(dpy, worker.surface, worker.surface, worker.context);
+					glFinish();
+				}
+				eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+				switchUs = std::max(0.0, switchTotalUs - baselineUs) / switches;
+
+				// Every context on its own thread at once
+				uint64_t runStart = NowNs();
+				for (ContextBenchWorker &worker : workers) {
+					worker.frames = 20;
+					pthread_create(&worker.thread, NULL, context_bench_func, &worker);
+				}
+				for (ContextBenchWorker &worker : workers)
+					pthread_join(worker.thread, NULL);
+				framesPerSecond = 20.0 * count / ((NowNs() - runStart) / 1e9);
+			}
+
+			for (ContextBenchWorker &worker : workers) {
+				if (worker.surface != EGL_NO_SURFACE)
+					eglDestroySurface(dpy, worker.surface);
+				if (worker.context != EGL_NO_CONTEXT)
+					eglDestroyContext(dpy, worker.context);
+			}
+			if (eglGetError() != EGL_SUCCESS || created != count) {
+				printf("%-12s %8d only %d contexts could be created\n", modeName, count, created);
+				continue;
+			}
+			printf("%-12s %8d %14.3f %14.3f %14.1f\n", modeName, count, createMs, switchUs, framesPerSecond);
+			any = true;
+		}
+		eglTerminate(dpy);
+		eglGetError();
+	}
+	return any;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [options]\n"
+		"  --size WxH             render target size (default 512x512)\n"
+		"  --display NAME         default, vulkan, swiftshader, gles, opengl, null, surfaceless or auto\n"
+		"  --dry-run              null backend and synthetic pixels: measure CPU overhead only\n"
+		"  --virtualize-contexts on|off  ANGLE context virtualization (default: backend's choice)\n"
+		"  --bench-contexts N,... compare physical and virtualized contexts for N workers\n"
+		"  --frames N             stop thread A after N frames (default: run forever)\n"
+		"  --stream y4m|rgba|nv12 stream thread A's frames instead of writing img.png\n"
+		"  --stream-out PATH      stream destination, '-' for stdout (default)\n"
+		"  --gpu-yuv              convert y4m/nv12 frames to YUV on the GPU before readback\n"
+		"  --dirty-rects          only render, read back and re-encode regions that changed\n"
+		"  --no-dedupe            encode and write every frame even if it repeats a recent one\n"
+		"  --fps N                frame rate advertised in the y4m header (default 30)\n"
+		"  --atlas N              render N thumbnails batched into an atlas instead\n"
+		"  --thumb WxH            thumbnail size for --atlas (default 64x64)\n"
+		"  --atlas-mode MODE      instanced (default) or scissored\n"
+		"  --atlas-contexts N     contexts rendering atlases in parallel (default 1)\n"
+		"  --cpu-workers N        threads encoding thumbnails (default: one per remaining core)\n"
+		"  --pin-gl CPUS          pin context threads to CPUS (e.g. 0-3,8 or node0), one core each\n"
+		"  --pin-cpu CPUS         pin encode and writer threads to CPUS, one core each\n"
+		"  --metrics-out PATH     write Prometheus metrics to PATH on SIGUSR1 and at exit\n"
+		"  --metrics-socket PATH  serve Prometheus metrics to clients of a Unix socket\n"
+		"  --trace PATH           write a Chrome trace (JSON) of the workers to PATH at exit\n"
+		"  --serve PATH           run as a render server on Unix socket PATH until SIGINT\n"
+		"  --serve-workers N      warm contexts serving requests (default 2)\n"
+		"  --request PATH         send --frames requests (default 1) of --size to a server\n"
+		"  --request-shm          receive the image in shared memory instead of inline\n"
+		"  --request-raw          ask for raw RGBA instead of PNG\n"
+		"  --request-out PATH     save the last image (default server.png)\n"
+		"  --shm-ring NAME        publish thread A's frames raw into shared memory NAME\n"
+		"  --shm-slots N          frames kept in the ring (default 4)\n"
+		"  --shm-consume NAME     consume frames from ring NAME (up to --frames)\n"
+		"  --shm-save PATH        with --shm-consume, save the newest frame as PNG\n"
+		"  --writer MODE          write --atlas thumbnails sync (default), uring or threads\n"
+		"  --write-direct         open output files with O_DIRECT where supported\n"
+		"  --write-fsync          fsync every output file before reporting it written\n"
+		"  --archive PATH         append every encoded image to one indexed archive file\n"
+		"  --archive-list PATH    verify an archive and print its contents\n",
+		prog);
+}
+
+int main(int argc, char **argv) {
 	/*
 	 * EGL initialization and OpenGL context creation.
 	 */
@@ -579,25 +5975,205 @@ int main() {
 	EGLint num_config;
 	EGLint width = 512;
 	EGLint height = 512;
+	int frames = 0;
+	const char *displayName = "default";
+	ContextVirtualization virtualization = VIRTUALIZE_DEFAULT;
+	std::vector<int> benchCounts;
+	const char *streamFormat = nullptr;
+	const char *streamOut = "-";
+	int fps = 30;
+	bool gpuYUV = false;
+	bool dirtyRects = false;
+	bool dedupe = true;
+	int atlasJobs = 0;
+	GLsizei thumbWidth = 64;
+	GLsizei thumbHeight = 64;
+	AtlasMode atlasMode = ATLAS_INSTANCED;
+	int atlasContexts = 1;
+	int cpuWorkers = -1;
+	const char *metricsOut = nullptr;
+	const char *metricsSocket = nullptr;
+	const char *tracePath = nullptr;
+	const char *serveSocket = nullptr;
+	int serveWorkers = 2;
+	const char *requestSocket = nullptr;
+	bool requestShm = false;
+	RenderEncoding requestEncoding = RENDER_ENCODING_PNG;
+	const char *requestOut = "server.png";
+	const char *ringName = nullptr;
+	int ringSlots = 4;
+	const char *consumeName = nullptr;
+	const char *consumeSave = nullptr;
+	const char *writerMode = "sync";
+	bool writeDirect = false;
+	bool writeFsync = false;
+	const char *archivePath = nullptr;
+	const char *archiveList = nullptr;
 
-	display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
-	assertEGLError("eglGetDisplay");
-	
-	eglInitialize(display, nullptr, nullptr);
-	assertEGLError("eglInitialize");
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+		if (!strcmp(arg, "--size") && value && sscanf(value, "%dx%d", &width, &height) == 2 &&
+				width > 0 && height > 0) {
+			i++;
+		} else if (!strcmp(arg, "--display") && value) {
+			displayName = value;
+			i++;
+		} else if (!strcmp(arg, "--dry-run")) {
+			gDryRun = true;
+		} else if (!strcmp(arg, "--virtualize-contexts") && value &&
+				(!strcmp(value, "on") || !strcmp(value, "off"))) {
+			virtualization = strcmp(value, "on") ? VIRTUALIZE_OFF : VIRTUALIZE_ON;
+			i++;
+		} else if (!strcmp(arg, "--bench-contexts") && value && ParseContextCounts(value, &benchCounts)) {
+			i++;
+		} else if (!strcmp(arg, "--frames") && value) {
+			frames = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--stream") && value) {
+			streamFormat = value;
+			i++;
+		} else if (!strcmp(arg, "--stream-out") && value) {
+			streamOut = value;
+			i++;
+		} else if (!strcmp(arg, "--gpu-yuv")) {
+			gpuYUV = true;
+		} else if (!strcmp(arg, "--dirty-rects")) {
+			dirtyRects = true;
+		} else if (!strcmp(arg, "--no-dedupe")) {
+			dedupe = false;
+		} else if (!strcmp(arg, "--fps") && value && atoi(value) > 0) {
+			fps = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--atlas") && value) {
+			atlasJobs = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--thumb") && value && sscanf(value, "%dx%d", &thumbWidth, &thumbHeight) == 2 &&
+				thumbWidth > 0 && thumbHeight > 0) {
+			i++;
+		} else if (!strcmp(arg, "--atlas-mode") && value &&
+				(!strcmp(value, "instanced") || !strcmp(value, "scissored"))) {
+			atlasMode = strcmp(value, "instanced") ? ATLAS_SCISSORED : ATLAS_INSTANCED;
+			i++;
+		} else if (!strcmp(arg, "--atlas-contexts") && value && atoi(value) > 0) {
+			atlasContexts = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--cpu-workers") && value && atoi(value) >= 0) {
+			cpuWorkers = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--pin-gl") && value) {
+			if (!CpuSetParse(&gPinGL, value))
+				return 1;
+			i++;
+		} else if (!strcmp(arg, "--pin-cpu") && value) {
+			if (!CpuSetParse(&gPinCPU, value))
+				return 1;
+			i++;
+		} else if (!strcmp(arg, "--metrics-out") && value) {
+			metricsOut = value;
+			i++;
+		} else if (!strcmp(arg, "--metrics-socket") && value) {
+			metricsSocket = value;
+			i++;
+		} else if (!strcmp(arg, "--trace") && value) {
+			tracePath = value;
+			i++;
+		} else if (!strcmp(arg, "--serve") && value) {
+			serveSocket = value;
+			i++;
+		} else if (!strcmp(arg, "--serve-workers") && value && atoi(value) > 0) {
+			serveWorkers = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--request") && value) {
+			requestSocket = value;
+			i++;
+		} else if (!strcmp(arg, "--request-shm")) {
+			requestShm = true;
+		} else if (!strcmp(arg, "--request-raw")) {
+			requestEncoding = RENDER_ENCODING_RGBA;
+		} else if (!strcmp(arg, "--request-out") && value) {
+			requestOut = value;
+			i++;
+		} else if (!strcmp(arg, "--shm-ring") && value) {
+			ringName = value;
+			i++;
+		} else if (!strcmp(arg, "--shm-slots") && value && atoi(value) > 0) {
+			ringSlots = atoi(value);
+			i++;
+		} else if (!strcmp(arg, "--shm-consume") && value) {
+			consumeName = value;
+			i++;
+		} else if (!strcmp(arg, "--shm-save") && value) {
+			consumeSave = value;
+			i++;
+		} else if (!strcmp(arg, "--writer") && value &&
+				(!strcmp(value, "sync") || !strcmp(value, "uring") || !strcmp(value, "threads"))) {
+			writerMode = value;
+			i++;
+		} else if (!strcmp(arg, "--write-direct")) {
+			writeDirect = true;
+		} else if (!strcmp(arg, "--write-fsync")) {
+			writeFsync = true;
+		} else if (!strcmp(arg, "--archive") && value) {
+			archivePath = value;
+			i++;
+		} else if (!strcmp(arg, "--archive-list") && value) {
+			archiveList = value;
+			i++;
+		} else {
+			usage(argv[0]);
+			return strcmp(arg, "--help") ? 1 : 0;
+		}
+	}
+
+	SinkFormat sinkFormat = SINK_Y4M;
+	if (streamFormat) {
+		if (!strcmp(streamFormat, "y4m")) {
+			sinkFormat = SINK_Y4M;
+		} else if (!strcmp(streamFormat, "rgba")) {
+			sinkFormat = SINK_RGBA;
+		} else if (!strcmp(streamFormat, "nv12")) {
+			sinkFormat = SINK_NV12;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+		// Display setup logs before the sink opens; keep it off the stream
+		if (!strcmp(streamOut, "-"))
+			FrameSinkClaimStdout();
+	}
+
+	// Clients need no EGL at all
+	if (requestSocket) {
+		return RenderClientRun(requestSocket, width, height, frames > 0 ? frames : 1,
+			requestEncoding, requestShm, requestOut) ? 0 : 1;
+	}
+	if (consumeName)
+		return FrameRingConsume(consumeName, frames, consumeSave) ? 0 : 1;
+	if (archiveList)
+		return ArchiveVerify(archiveList) ? 0 : 1;
+	if (!benchCounts.empty())
+		return BenchContexts(gDryRun ? "null" : displayName, benchCounts) ? 0 : 1;
+
+	if (tracePath) {
+		gTraceEnabled.store(true, std::memory_order_relaxed);
+		TraceSetThreadName("main");
+	}
+
+	// Select the display before opening any output, so an unavailable
+	// backend leaves nothing behind. A dry run always uses the null backend,
+	// whatever else was asked for.
+	display = SelectDisplay(gDryRun ? "null" : displayName, virtualization);
+	if (display == EGL_NO_DISPLAY)
+		return 1;
+	InitFenceSync(display);
+	InitEGLImage(display);
 	
 	EGLint allConfigCount = 0;
 	eglGetConfigs(display, nullptr, 0, &allConfigCount);
 	assertEGLError("eglGetConfigs");
 
-	const EGLint configAttribs[] = {
-		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
-		EGL_RED_SIZE, 8,
-		EGL_GREEN_SIZE, 8,
-		EGL_BLUE_SIZE, 8,
-		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT,
-		EGL_NONE
-	};
+	const EGLint *configAttribs = kDisplayConfigAttribs;
 
 	std::vector<EGLConfig> defaultConfigs(allConfigCount);
 	if (!eglChooseConfig(display, configAttribs, defaultConfigs.data(), (int)defaultConfigs.size(), &num_config) ||
@@ -613,18 +6189,18 @@ int main() {
 
 	eglBindAPI(EGL_OPENGL_ES_API);
 	assertEGLError("eglBindAPI");
-/*
-	// Create a GL context
-	const GLint contextAttribs[] = {
-		EGL_CONTEXT_CLIENT_VERSION, 2,
+	// Create the loader context. It roots the share group of every worker
+	// context and stays current on the main thread for uploads.
+	static const GLint contextAttribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 3,
 		EGL_NONE
 	};
 	context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
 	assertEGLError("eglCreateContext");
 
-	const EGLint pbufAttribs[] = {
-		EGL_WIDTH, width,
-		EGL_HEIGHT, height,
+	static const EGLint pbufAttribs[] = {
+		EGL_WIDTH, 1,
+		EGL_HEIGHT, 1,
 		EGL_NONE
 	};
 
@@ -633,7 +6209,6 @@ int main() {
 	
 	eglMakeCurrent(display, surface, surface, context);
 	assertEGLError("eglMakeCurrent");
-*/
 	printf("main thread inside %#x display %p config %p\n", gettid(), display, config);
 
 	//
@@ -651,18 +6226,161 @@ int main() {
 	 */
 	printf("support color format %#04x type %#04x\n", format, type);
 
+	// Sizes are only known to fit once a context can be asked
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	if (width > maxTextureSize || height > maxTextureSize ||
+			thumbWidth > maxTextureSize || thumbHeight > maxTextureSize) {
+		printf("sizes are limited to GL_MAX_TEXTURE_SIZE %d\n", maxTextureSize);
+		usage(argv[0]);
+		return 1;
+	}
+
+	FrameSink sink;
+	FrameSink *sinkPtr = nullptr;
+	if (streamFormat) {
+		if (!FrameSinkOpen(&sink, streamOut, sinkFormat, width, height, fps))
+			return 1;
+		sink.dedupe = dedupe;
+		sinkPtr = &sink;
+	}
+
+	FrameRing ring;
+	FrameRing *ringPtr = nullptr;
+	if (ringName) {
+		if (!FrameRingCreate(&ring, ringName, ringSlots, width, height)) {
+			if (sinkPtr)
+				FrameSinkClose(sinkPtr);
+			return 1;
+		}
+		ringPtr = &ring;
+	}
+
+	AsyncWriter writer;
+	AsyncWriter *writerPtr = nullptr;
+	if (strcmp(writerMode, "sync")) {
+		AsyncWriterStart(&writer, strcmp(writerMode, "uring") ? WRITER_THREADS : WRITER_URING, 4,
+			writeDirect, writeFsync, 1024);
+		writerPtr = &writer;
+	}
+
+	ArchiveWriter archive;
+	ArchiveWriter *archivePtr = nullptr;
+	if (archivePath) {
+		if (!ArchiveOpen(&archive, archivePath)) {
+			if (sinkPtr)
+				FrameSinkClose(sinkPtr);
+			if (ringPtr)
+				FrameRingClose(ringPtr);
+			if (writerPtr)
+				AsyncWriterStop(writerPtr);
+			return 1;
+		}
+		archivePtr = &archive;
+	}
+
+	MetricsExporter metrics;
+	bool exportMetrics = metricsOut || metricsSocket;
+	if (exportMetrics && !MetricsExporterStart(&metrics, metricsOut, metricsSocket)) {
+		if (sinkPtr)
+			FrameSinkClose(sinkPtr);
+		if (ringPtr)
+			FrameRingClose(ringPtr);
+		if (writerPtr)
+			AsyncWriterStop(writerPtr);
+		if (archivePtr) {
+			ArchiveClose(archivePtr);
+			unlink(archivePath);
+		}
+		return 1;
+	}
+
+	// Upload shared assets once, off the render threads
+	UploadQueue uploader;
+	UploadQueueStart(&uploader, display, config, context);
+	Asset simpleAsset;
+	simpleAsset.decode = DecodeSimpleTexture2D;
+	simpleAsset.userdata = nullptr;
+	UploadQueueSubmit(&uploader, &simpleAsset);
+
+	if (cpuWorkers < 0 && !gPinCPU.cpus.empty()) {
+		cpuWorkers = (int)gPinCPU.cpus.size();
+	} else if (cpuWorkers < 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		cpuWorkers = cores > atlasContexts ? (int)cores - atlasContexts : 0;
+	}
+
 	GLContext glCtx = {
 		.dpy = display,
 		.config = config,
 		.width = width,
 		.height = height,
+		.shareContext = context,
+		.sharedAsset = &simpleAsset,
+		.sink = sinkPtr,
+		.gpuYUV = gpuYUV,
+		.dirtyRects = dirtyRects,
+		.dedupe = dedupe,
+		.frames = frames,
+		.ring = ringPtr,
+		.writer = writerPtr,
+		.archive = archivePtr,
+		.atlasJobs = atlasJobs,
+		.atlasContexts = atlasContexts,
+		.cpuWorkers = cpuWorkers,
+		.thumbWidth = thumbWidth,
+		.thumbHeight = thumbHeight,
+		.atlasMode = atlasMode,
 	};
-	pthread_t threadA, threadB;
-	pthread_create(&threadA, NULL, thread_func_a, &glCtx);
-	sleep(0.5);
-	pthread_create(&threadB, NULL, thread_func_b, &glCtx);
-	pthread_join(threadA, NULL);
-	pthread_join(threadB, NULL);
+	uint64_t runStart = NowNs();
+	if (serveSocket) {
+		RenderServerRun(&glCtx, serveSocket, serveWorkers);
+	} else if (atlasJobs > 0) {
+		AtlasRun(&glCtx);
+	} else {
+		pthread_t threadA, threadB;
+		pthread_create(&threadA, NULL, thread_func_a, &glCtx);
+		// Let A set up first; a dry run times only the workers
+		if (!gDryRun)
+			usleep(500 * 1000);
+		pthread_create(&threadB, NULL, thread_func_b, &glCtx);
+		pthread_join(threadA, NULL);
+		pthread_join(threadB, NULL);
+	}
+	if (gDryRun) {
+		double seconds = (NowNs() - runStart) / 1e9;
+		uint64_t rendered = MetricValue(&gMetrics.framesRendered);
+		uint64_t encoded = MetricValue(&gMetrics.framesEncoded);
+		printf("dry run: %llu jobs rendered, %llu encoded in %.3f s (%.1f jobs/s)\n",
+			(unsigned long long)rendered, (unsigned long long)encoded, seconds,
+			seconds > 0.0 ? rendered / seconds : 0.0);
+	}
+	if (sinkPtr)
+		FrameSinkClose(sinkPtr);
+	if (ringPtr)
+		FrameRingClose(ringPtr);
+	if (writerPtr)
+		AsyncWriterStop(writerPtr);
+	if (archivePtr) {
+		uint64_t count = archivePtr->index.size(), bytes = archivePtr->offset - sizeof(ArchiveHeader);
+		if (ArchiveClose(archivePtr))
+			printf("archived %llu images (%llu bytes) in %s\n", (unsigned long long)count,
+				(unsigned long long)bytes, archivePath);
+		else
+			printf("failed to finish archive %s\n", archivePath);
+	}
+
+	UploadQueueStop(&uploader);
+	if (exportMetrics)
+		MetricsExporterStop(&metrics);
+	if (tracePath && TraceWriteJSON(tracePath))
+		printf("wrote trace to %s\n", tracePath);
+	AssetDestroy(display, &simpleAsset);
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglDestroySurface(display, surface);
+	assertEGLError("eglDestroySurface");
+	eglDestroyContext(display, context);
+	assertEGLError("eglDestroyContext");
 
 	eglTerminate(display);
 	assertEGLError("eglTerminate");
@@ -27,6 +27,9 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
 #include <vector>
 #include <string>
 
@@ -44,6 +47,11 @@
 #include <GLES/gl.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
+#include <GLES3/gl3.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 
@@ -77,6 +85,15 @@ int glUtilsPixelBitSize(GLenum format, GLenum type)
 		break;
 	case GL_SHORT:
 	case GL_UNSIGNED_SHORT:
+	case GL_HALF_FLOAT:
+	case GL_HALF_FLOAT_OES:
+		componentsize = 16;
+		break;
+	case GL_INT:
+	case GL_UNSIGNED_INT:
+	case GL_FLOAT:
+		componentsize = 32;
+		break;
 	case GL_UNSIGNED_SHORT_5_6_5:
 	case GL_UNSIGNED_SHORT_4_4_4_4:
 	case GL_UNSIGNED_SHORT_5_5_5_1:
@@ -85,9 +102,6 @@ int glUtilsPixelBitSize(GLenum format, GLenum type)
 	case GL_RGBA4_OES:
 		pixelsize = 16;
 		break;
-	case GL_INT:
-	case GL_UNSIGNED_INT:
-	case GL_FLOAT:
 	case GL_FIXED:
 	case GL_UNSIGNED_INT_24_8_OES:
 		pixelsize = 32;
@@ -153,6 +167,254 @@ GLsizei pixelDataSize(GLsizei width, GLsizei height, GLenum format, GLenum type)
 	return aligned_linesize * height;
 }
 
+///
+// Readback format negotiation.
+//
+// glReadPixels always accepts GL_RGBA/GL_UNSIGNED_BYTE, but then the driver
+// may have to convert every pixel of the attachment on the way out. The one
+// other combination it must accept, GL_IMPLEMENTATION_COLOR_READ_FORMAT and
+// _TYPE, is the attachment's native layout, so it is read back as is and we
+// expand it to RGBA8 on the CPU only when the encoder cannot take it.
+//
+typedef struct ReadbackFormat {
+	GLenum format;
+	GLenum type;
+} ReadbackFormat;
+
+static const ReadbackFormat kReadbackRGBA = { GL_RGBA, GL_UNSIGNED_BYTE };
+static const ReadbackFormat kReadbackFloat = { GL_RGBA, GL_FLOAT };
+
+static bool ReadbackSupported(ReadbackFormat f)
+{
+	switch (f.type) {
+	case GL_UNSIGNED_BYTE:
+		return f.format == GL_RGBA || f.format == GL_BGRA_EXT || f.format == GL_RGB;
+	case GL_UNSIGNED_SHORT_5_6_5:
+		return f.format == GL_RGB;
+	case GL_UNSIGNED_SHORT_4_4_4_4:
+	case GL_UNSIGNED_SHORT_5_5_5_1:
+	case GL_HALF_FLOAT:
+	case GL_HALF_FLOAT_OES:
+	case GL_FLOAT:
+		return f.format == GL_RGBA;
+	default:
+		return false;
+	}
+}
+
+///
+// Pick the format to read the bound framebuffer with. With preferNative the
+// implementation's own format is used whenever we can convert from it.
+// Floating point attachments can only fall back to GL_RGBA/GL_FLOAT.
+//
+ReadbackFormat NegotiateReadFormat(bool preferNative, bool floatTarget)
+{
+	GLint format = 0, type = 0;
+	glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &format);
+	glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &type);
+	assertOpenGLError("GL_IMPLEMENTATION_COLOR_READ_FORMAT");
+
+	ReadbackFormat native = { (GLenum)format, (GLenum)type };
+	if (preferNative && ReadbackSupported(native))
+		return native;
+	return floatTarget ? kReadbackFloat : kReadbackRGBA;
+}
+
+///
+// Number of channels the encoder can take the readback in directly, or 0 if
+// it must go through ConvertToRGBA8 first.
+//
+int ReadbackChannels(ReadbackFormat f)
+{
+	if (f.type != GL_UNSIGNED_BYTE)
+		return 0;
+	if (f.format == GL_RGBA)
+		return 4;
+	if (f.format == GL_RGB)
+		return 3;
+	return 0;
+}
+
+#if defined(__SSE2__)
+// Widen n-bit channels in 16-bit lanes to 8 bits by bit replication.
+static inline __m128i Expand5(__m128i v) { return _mm_or_si128(_mm_slli_epi16(v, 3), _mm_srli_epi16(v, 2)); }
+static inline __m128i Expand6(__m128i v) { return _mm_or_si128(_mm_slli_epi16(v, 2), _mm_srli_epi16(v, 4)); }
+static inline __m128i Expand4(__m128i v) { return _mm_or_si128(_mm_slli_epi16(v, 4), v); }
+
+// Interleave eight pixels of 8-bit channels held in 16-bit lanes into RGBA8.
+static inline void StoreRGBA8x8(uint8_t *dst, __m128i r, __m128i g, __m128i b, __m128i a)
+{
+	__m128i rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+	__m128i ba = _mm_or_si128(b, _mm_slli_epi16(a, 8));
+	_mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(rg, ba));
+	_mm_storeu_si128((__m128i *)(dst + 16), _mm_unpackhi_epi16(rg, ba));
+}
+#endif
+
+static void ConvertRowToRGBA8(const uint8_t *src, ReadbackFormat f, GLsizei width, uint8_t *dst)
+{
+	const uint16_t *src16 = (const uint16_t *)src;
+	GLsizei x = 0;
+
+	if (f.type == GL_UNSIGNED_BYTE && f.format == GL_BGRA_EXT) {
+#if defined(__SSE2__)
+		const __m128i agMask = _mm_set1_epi32((int)0xFF00FF00);
+		for (; x + 4 <= width; x += 4) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+			__m128i rb = _mm_andnot_si128(agMask, v);
+			rb = _mm_or_si128(_mm_slli_epi32(rb, 16), _mm_srli_epi32(rb, 16));
+			_mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(_mm_and_si128(v, agMask), rb));
+		}
+#endif
+		for (; x < width; x++) {
+			dst[x * 4 + 0] = src[x * 4 + 2];
+			dst[x * 4 + 1] = src[x * 4 + 1];
+			dst[x * 4 + 2] = src[x * 4 + 0];
+			dst[x * 4 + 3] = src[x * 4 + 3];
+		}
+	} else if (f.type == GL_UNSIGNED_BYTE) {
+		const int channels = f.format == GL_RGB ? 3 : 4;
+		for (; x < width; x++) {
+			dst[x * 4 + 0] = src[x * channels + 0];
+			dst[x * 4 + 1] = src[x * channels + 1];
+			dst[x * 4 + 2] = src[x * channels + 2];
+			dst[x * 4 + 3] = channels == 4 ? src[x * channels + 3] : 255;
+		}
+	} else if (f.type == GL_UNSIGNED_SHORT_5_6_5) {
+#if defined(__SSE2__)
+		const __m128i m5 = _mm_set1_epi16(0x1F), m6 = _mm_set1_epi16(0x3F);
+		const __m128i opaque = _mm_set1_epi16(0xFF);
+		for (; x + 8 <= width; x += 8) {
+			__m128i p = _mm_loadu_si128((const __m128i *)(src16 + x));
+			__m128i r = Expand5(_mm_srli_epi16(p, 11));
+			__m128i g = Expand6(_mm_and_si128(_mm_srli_epi16(p, 5), m6));
+			__m128i b = Expand5(_mm_and_si128(p, m5));
+			StoreRGBA8x8(dst + x * 4, r, g, b, opaque);
+		}
+#endif
+		for (; x < width; x++) {
+			uint16_t p = src16[x];
+			uint8_t r = p >> 11, g = (p >> 5) & 0x3F, b = p & 0x1F;
+			dst[x * 4 + 0] = (r << 3) | (r >> 2);
+			dst[x * 4 + 1] = (g << 2) | (g >> 4);
+			dst[x * 4 + 2] = (b << 3) | (b >> 2);
+			dst[x * 4 + 3] = 255;
+		}
+	} else if (f.type == GL_UNSIGNED_SHORT_4_4_4_4) {
+#if defined(__SSE2__)
+		const __m128i m4 = _mm_set1_epi16(0xF);
+		for (; x + 8 <= width; x += 8) {
+			__m128i p = _mm_loadu_si128((const __m128i *)(src16 + x));
+			__m128i r = Expand4(_mm_srli_epi16(p, 12));
+			__m128i g = Expand4(_mm_and_si128(_mm_srli_epi16(p, 8), m4));
+			__m128i b = Expand4(_mm_and_si128(_mm_srli_epi16(p, 4), m4));
+			__m128i a = Expand4(_mm_and_si128(p, m4));
+			StoreRGBA8x8(dst + x * 4, r, g, b, a);
+		}
+#endif
+		for (; x < width; x++) {
+			uint16_t p = src16[x];
+			dst[x * 4 + 0] = (p >> 12) * 17;
+			dst[x * 4 + 1] = ((p >> 8) & 0xF) * 17;
+			dst[x * 4 + 2] = ((p >> 4) & 0xF) * 17;
+			dst[x * 4 + 3] = (p & 0xF) * 17;
+		}
+	} else if (f.type == GL_UNSIGNED_SHORT_5_5_5_1) {
+		for (; x < width; x++) {
+			uint16_t p = src16[x];
+			uint8_t r = p >> 11, g = (p >> 6) & 0x1F, b = (p >> 1) & 0x1F;
+			dst[x * 4 + 0] = (r << 3) | (r >> 2);
+			dst[x * 4 + 1] = (g << 3) | (g >> 2);
+			dst[x * 4 + 2] = (b << 3) | (b >> 2);
+			dst[x * 4 + 3] = (p & 1) ? 255 : 0;
+		}
+	}
+}
+
+///
+// Expand pixels read back in format f to tightly packed RGBA8.
+//
+void ConvertToRGBA8(const uint8_t *src, GLsizei srcStride, ReadbackFormat f,
+	GLsizei width, GLsizei height, uint8_t *dst)
+{
+	for (GLsizei y = 0; y < height; y++)
+		ConvertRowToRGBA8(src + (size_t)y * srcStride, f, width, dst + (size_t)y * width * 4);
+}
+
+///
+// Half to single precision conversion for HDR readback.
+//
+static float HalfToFloat(uint16_t h)
+{
+	uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1F;
+	uint32_t mant = h & 0x3FF;
+	uint32_t bits;
+
+	if (exp == 0x1F) {
+		bits = sign | 0x7F800000 | (mant << 13);  // inf or nan
+	} else if (exp != 0) {
+		bits = sign | ((exp + 112) << 23) | (mant << 13);
+	} else if (mant != 0) {
+		// Denormal: renormalize
+		exp = 113;
+		while (!(mant & 0x400)) {
+			mant <<= 1;
+			exp--;
+		}
+		bits = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+	} else {
+		bits = sign;
+	}
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+}
+
+#if defined(__SSE2__)
+///
+// Convert four halves in the low 16 bits of each lane. Exponent and
+// mantissa are shifted into place and rebiased with one multiply by 2^112,
+// which also normalizes denormals; inf and nan get their exponent forced.
+//
+static inline __m128 HalfToFloat4(__m128i h)
+{
+	const __m128i maskNoSign = _mm_set1_epi32(0x7FFF);
+	const __m128 magic = _mm_castsi128_ps(_mm_set1_epi32((254 - 15) << 23));
+	const __m128i wasInfNan = _mm_set1_epi32(0x7BFF);
+	const __m128i expInfNan = _mm_set1_epi32(255 << 23);
+
+	__m128i expmant = _mm_and_si128(maskNoSign, h);
+	__m128i justsign = _mm_xor_si128(h, expmant);
+	__m128 scaled = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(expmant, 13)), magic);
+	__m128i infnan = _mm_and_si128(_mm_cmpgt_epi32(expmant, wasInfNan), expInfNan);
+	__m128i sign = _mm_slli_epi32(justsign, 16);
+	return _mm_or_ps(scaled, _mm_castsi128_ps(_mm_or_si128(sign, infnan)));
+}
+#endif
+
+void ConvertHalfToFloat(const uint16_t *src, size_t count, float *dst)
+{
+	size_t i = 0;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	for (; i + 8 <= count; i += 8) {
+		__m128i h = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_ps(dst + i, HalfToFloat4(_mm_unpacklo_epi16(h, zero)));
+		_mm_storeu_ps(dst + i + 4, HalfToFloat4(_mm_unpackhi_epi16(h, zero)));
+	}
+#endif
+	for (; i < count; i++)
+		dst[i] = HalfToFloat(src[i]);
+}
+
+static double NowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
 ///
 // Create a shader object, load the shader source, and
 // compile the shader.
@@ -209,10 +471,11 @@ GLuint init_triangle()
 	char fShaderStr[] =
 		"#version 300 es                              \n"
 		"precision mediump float;                     \n"
+		"uniform float u_intensity;                   \n"
 		"out vec4 fragColor;                          \n"
 		"void main()                                  \n"
 		"{                                            \n"
-		"   fragColor = vec4 ( 1.0, 0.0, 0.0, 1.0 );  \n"
+		"   fragColor = vec4 ( u_intensity, 0.0, 0.0, 1.0 );\n"
 		"}                                            \n";
 
 	GLuint vertexShader;
@@ -259,7 +522,7 @@ GLuint init_triangle()
 ///
 // Draw a triangle using the shader pair created in Init()
 //
-void draw_triangle(GLsizei width, GLsizei height)
+void draw_triangle(GLsizei width, GLsizei height, GLfloat intensity)
 {
 	GLfloat vVertices[] = { 0.0f,  0.5f, 0.0f,
 							 -0.5f, -0.5f, 0.0f,
@@ -276,6 +539,7 @@ void draw_triangle(GLsizei width, GLsizei height)
 
 	// Use the program object
 	glUseProgram(program);
+	glUniform1f(glGetUniformLocation(program, "u_intensity"), intensity);
 
 	// Load the vertex data
 	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, vVertices);
@@ -284,7 +548,65 @@ void draw_triangle(GLsizei width, GLsizei height)
 	glDrawArrays(GL_TRIANGLES, 0, 3);
 }
 
-int main() {
+///
+// Color attachment formats. The 16-bit ones halve the bandwidth of
+// rendering, readback and storage, which is plenty for previews.
+//
+typedef struct ColorFormat {
+	const char *name;
+	GLenum internalFormat;
+	GLenum format;
+	GLenum type;
+} ColorFormat;
+
+static const ColorFormat kColorFormats[] = {
+	{ "rgb8",     GL_RGB,     GL_RGB,  GL_UNSIGNED_BYTE },
+	{ "rgba8",    GL_RGBA,    GL_RGBA, GL_UNSIGNED_BYTE },
+	{ "rgb565",   GL_RGB565,  GL_RGB,  GL_UNSIGNED_SHORT_5_6_5 },
+	{ "rgba4444", GL_RGBA4,   GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4 },
+	{ "rgb5a1",   GL_RGB5_A1, GL_RGBA, GL_UNSIGNED_SHORT_5_5_5_1 },
+	{ "rgba16f",  GL_RGBA16F, GL_RGBA, GL_HALF_FLOAT },
+};
+
+static const ColorFormat *FindColorFormat(const char *name)
+{
+	for (const ColorFormat &f : kColorFormats) {
+		if (!strcmp(f.name, name))
+			return &f;
+	}
+	return nullptr;
+}
+
+///
+// Write the readback as is, rows bottom-up without padding, so 16-bit
+// formats keep their size on disk.
+//
+static bool WriteRaw(const char *path, const uint8_t *data, GLsizei rowBytes, GLsizei stride, GLsizei height)
+{
+	FILE *file = fopen(path, "wb");
+	if (!file) {
+		printf("cannot open %s\n", path);
+		return false;
+	}
+	bool ok = true;
+	for (GLsizei y = 0; y < height && ok; y++)
+		ok = fwrite(data + (size_t)y * stride, 1, rowBytes, file) == (size_t)rowBytes;
+	return fclose(file) == 0 && ok;
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [options]\n"
+		"  --readback MODE        native (default) reads in the implementation's\n"
+		"                         preferred format, rgba always reads GL_RGBA\n"
+		"  --format FMT           color attachment: rgb8 (default), rgba8, rgb565,\n"
+		"                         rgba4444, rgb5a1 or rgba16f (HDR, saved as img.hdr)\n"
+		"  --intensity X          red level of the triangle, above 1 for HDR (default 1)\n"
+		"  --raw                  also write the readback unconverted to img.raw\n"
+		"  --help                 show this message\n", prog);
+}
+
+int main(int argc, char **argv) {
 	/*
 	 * EGL initialization and OpenGL context creation.
 	 */
@@ -297,6 +619,31 @@ int main() {
 	GLint height = 512;
 	EGLint es_version = 3;
 	EGLint egl_renderable_type = EGL_OPENGL_ES3_BIT;
+	bool nativeReadback = true;
+	const ColorFormat *colorFormat = &kColorFormats[0];
+	bool writeRaw = false;
+	GLfloat intensity = 1.0f;
+
+	for (int i = 1; i < argc; i++) {
+		const char *arg = argv[i];
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (!strcmp(arg, "--readback") && value &&
+				(!strcmp(value, "native") || !strcmp(value, "rgba"))) {
+			nativeReadback = !strcmp(value, "native");
+			i++;
+		} else if (!strcmp(arg, "--format") && value && FindColorFormat(value)) {
+			colorFormat = FindColorFormat(value);
+			i++;
+		} else if (!strcmp(arg, "--intensity") && value) {
+			intensity = (GLfloat)atof(value);
+			i++;
+		} else if (!strcmp(arg, "--raw")) {
+			writeRaw = true;
+		} else {
+			usage(argv[0]);
+			return strcmp(arg, "--help") ? 1 : 0;
+		}
+	}
 
 	display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
 	assertEGLError("eglGetDisplay");
@@ -352,6 +699,18 @@ int main() {
 	eglMakeCurrent(display, surface, surface, context);
 	assertEGLError("eglMakeCurrent");
 	
+	// Rendering to half floats needs EXT_color_buffer_half_float, or
+	// EXT_color_buffer_float which implies it on ES 3.0
+	const bool hdr = colorFormat->type == GL_HALF_FLOAT;
+	if (hdr) {
+		const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+		if (!extensions || (!strstr(extensions, "GL_EXT_color_buffer_half_float") &&
+				!strstr(extensions, "GL_EXT_color_buffer_float"))) {
+			printf("%s render targets are not supported\n", colorFormat->name);
+			return 1;
+		}
+	}
+
 	/*
 	 * Create an OpenGL framebuffer as render target.
 	 */
@@ -367,7 +726,8 @@ int main() {
 	glGenTextures(1, &tex);
 
 	glBindTexture(GL_TEXTURE_2D, tex);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	glTexImage2D(GL_TEXTURE_2D, 0, colorFormat->internalFormat, width, height, 0,
+		colorFormat->format, colorFormat->type, nullptr);
 	assertOpenGLError("glTexImage2D");
 	
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -385,20 +745,22 @@ int main() {
 	 */
 	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
 	assertOpenGLError("glFramebufferTexture2D");
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		printf("%s color attachment is not renderable\n", colorFormat->name);
+		return 1;
+	}
 	
 	// check the output format
 	// This is critical to knowing what surface format just got created
 	// ES only supports 5-6-5 and other limited formats and the driver
 	// might have picked another format
-	GLint format = 0, type = 0;
-	glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &format);
-	glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &type);
+	ReadbackFormat readFormat = NegotiateReadFormat(nativeReadback, hdr);
 	/*
 	 * We got returned format and type
 	 * #define GL_RGBA                           0x1908
 	 * #define GL_UNSIGNED_BYTE                  0x1401
 	 */
-	printf("support color format %#04x type %#04x\n", format, type);
+	printf("support color format %#04x type %#04x\n", readFormat.format, readFormat.type);
 	/*
 	 * Render something.
 	 */
@@ -409,27 +771,65 @@ int main() {
 	glFlush();
 #endif
 
-	draw_triangle(width, height);
+	draw_triangle(width, height, intensity);
 
 	/*
 	 * Read the framebuffer's color attachment and save it as a PNG file.
 	 */
-	GLsizei nr_channels = 4;
-	GLsizei stride = nr_channels * width;
-	stride += (stride % 4) ? (4 - stride % 4) : 0;
-	GLsizei bufferSize = stride * height;
-	//GLsizei bufferSize = pixelDataSize(width, height, format, type);
-	vector<char> buffer(bufferSize);
+	// Rows are padded to GL_PACK_ALIGNMENT (4), as pixelDataSize assumes
+	GLsizei stride = pixelDataSize(width, 1, readFormat.format, readFormat.type);
+	GLsizei bufferSize = pixelDataSize(width, height, readFormat.format, readFormat.type);
+	vector<uint8_t> buffer(bufferSize);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, frameBuffer);
 	assertOpenGLError("glBindFramebuffer");
 	
-	//glReadPixels: format only accepts GL_RGBA and GL_RGBA_INTEGER. 
-	//type must be one of GL_UNSIGNED_BYTE, GL_UNSIGNED_INT, GL_INT, or GL_FLOAT.
-	glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, buffer.data());
+	//glReadPixels: format accepts GL_RGBA, GL_RGBA_INTEGER, or the
+	//implementation color read format/type negotiated above.
+	double start = NowMs();
+	glReadPixels(0, 0, width, height, readFormat.format, readFormat.type, buffer.data());
 	assertOpenGLError("glReadPixels");
+	double readMs = NowMs() - start;
+
+	// Encode directly when the encoder understands the layout
+	GLsizei nr_channels = ReadbackChannels(readFormat);
+	const uint8_t *pixels = buffer.data();
+	vector<uint8_t> converted;
+	vector<float> hdrPixels;
+	if (hdr) {
+		// Rows of four-channel halves or floats are never padded
+		const size_t count = (size_t)width * height * 4;
+		if (readFormat.type == GL_FLOAT) {
+			hdrPixels.assign((const float *)buffer.data(), (const float *)buffer.data() + count);
+		} else {
+			start = NowMs();
+			hdrPixels.resize(count);
+			ConvertHalfToFloat((const uint16_t *)buffer.data(), count, hdrPixels.data());
+			printf("converted halves to floats in %.3f ms\n", NowMs() - start);
+		}
+	} else if (nr_channels == 0) {
+		start = NowMs();
+		converted.resize((size_t)width * height * 4);
+		ConvertToRGBA8(buffer.data(), stride, readFormat, width, height, converted.data());
+		printf("converted to RGBA8 in %.3f ms\n", NowMs() - start);
+		nr_channels = 4;
+		stride = width * 4;
+		pixels = converted.data();
+	}
+	printf("read %d bytes in %.3f ms\n", bufferSize, readMs);
+
+	if (writeRaw) {
+		GLsizei rowBytes = width * (glUtilsPixelBitSize(readFormat.format, readFormat.type) >> 3);
+		GLsizei rawStride = pixelDataSize(width, 1, readFormat.format, readFormat.type);
+		if (WriteRaw("img.raw", buffer.data(), rowBytes, rawStride, height))
+			printf("wrote img.raw: %dx%d format %#04x type %#04x, bottom-up\n",
+				width, height, readFormat.format, readFormat.type);
+	}
 
-	stbi_write_png("img.png", width, height, nr_channels, buffer.data(), stride);
+	if (hdr)
+		stbi_write_hdr("img.hdr", width, height, 4, hdrPixels.data());
+	else
+		stbi_write_png("img.png", width, height, nr_channels, pixels, stride);
 	
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	/*